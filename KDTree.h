@@ -1,10 +1,21 @@
+#pragma once
+
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <scoped_allocator>
 #include <set>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "KDTreeMetrics.h"
+
 #ifdef ENABLE_GBI_ASSERTS
     #include <cassert>
     #define gbiAssert assert
@@ -20,31 +31,111 @@ typedef int32_t Int;
 typedef void* PointData;
 typedef std::vector<PointData>::size_type SizeT;
 
-template<typename PointWrapper, UInt Dimension>
+// Metric is one of the policies from KDTreeMetrics.h, used by distance based queries.
+// Allocator is rebound for every internal container, down to the ones nested in
+// indexByBalanceAndFloor. Once Reserve has been called, updates no longer allocate arrays, but the
+// hash maps and indexByBalanceAndFloor still allocate and free a node for every entry they add or
+// remove: only an allocator pooling nodes keeps updates away from the system allocator.
+template<
+    typename PointWrapper,
+    UInt Dimension,
+    bool TrackCoordinateSums = false,
+    typename Metric = SquaredEuclideanMetric,
+    typename Allocator = std::allocator<PointData>>
 class KDTree
 {
-    std::vector<PointData> pointDataVector;
-    std::unordered_map<PointData, SizeT> indexedPointData;
+    typedef typename std::decay<decltype(std::declval<PointWrapper &>().Get(0))>::type Coordinate;
 
-    std::unordered_map<SizeT, UInt> nodeFloor;
+    template<typename T>
+    using AllocatorFor = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
 
-    std::unordered_map<SizeT, SizeT> lowerIndex;
-    std::unordered_map<SizeT, SizeT> upperIndex;
-    std::unordered_map<SizeT, SizeT> parentIndex;
+    template<typename T>
+    using Vector = std::vector<T, AllocatorFor<T>>;
 
-    std::unordered_map<PointData, std::array<PointData, Dimension * 2>> boundaries;
+    template<typename Key, typename Value>
+    using UnorderedMap = std::unordered_map<Key, Value, std::hash<Key>, std::equal_to<Key>, AllocatorFor<std::pair<const Key, Value>>>;
 
-    std::unordered_map<SizeT, Int> balanceByIndex;
-    std::map<Int, std::map<UInt, std::set<SizeT>>> indexByBalanceAndFloor;
+    // Ordered containers are nested, the scoped adaptor hands their allocator down to the containers
+    // they create
+    template<typename Key, typename Value>
+    using Map = std::map<Key, Value, std::less<Key>, std::scoped_allocator_adaptor<AllocatorFor<std::pair<const Key, Value>>>>;
+
+    template<typename Key>
+    using Set = std::set<Key, std::less<Key>, std::scoped_allocator_adaptor<AllocatorFor<Key>>>;
+
+    // Node of the read-only layout built by Freeze. Index 0 is origin, which is never a child,
+    // so 0 also stands for "no child".
+    struct FrozenNode
+    {
+        PointData point;
+        SizeT lower;
+        SizeT upper;
+        // Points left in the subtree, erased ones excluded
+        SizeT subtreeSize;
+        // Erasing only marks the node, which stays in the layout until it is rebuilt
+        bool erased;
+        std::array<Coordinate, Dimension> coordinates;
+        // Subtree AABB, the node itself included
+        std::array<Coordinate, Dimension> lowestCoordinates;
+        std::array<Coordinate, Dimension> highestCoordinates;
+    };
+
+    Vector<PointData> pointDataVector;
+    UnorderedMap<PointData, SizeT> indexedPointData;
+
+    UnorderedMap<SizeT, UInt> nodeFloor;
+
+    UnorderedMap<SizeT, SizeT> lowerIndex;
+    UnorderedMap<SizeT, SizeT> upperIndex;
+    UnorderedMap<SizeT, SizeT> parentIndex;
+
+    UnorderedMap<PointData, std::array<PointData, Dimension * 2>> boundaries;
+
+    UnorderedMap<SizeT, Int> balanceByIndex;
+    Map<Int, Map<UInt, Set<SizeT>>> indexByBalanceAndFloor;
+
+    // Number of points in the subtree rooted at an index, the index itself included
+    UnorderedMap<SizeT, SizeT> subtreeSizeByIndex;
+    // Only maintained when TrackCoordinateSums is set
+    UnorderedMap<SizeT, std::array<double, Dimension>> coordinateSumByIndex;
+
+    // Frozen layout, in van Emde Boas order
+    Vector<FrozenNode> frozenNodes;
+    Vector<std::array<double, Dimension>> frozenCoordinateSums;
+    SizeT frozenErasedCount;
+
+    // Scratch buffers reused by Insert and Erase
+    Vector<PointData> insertPath;
+    Vector<SizeT> eraseSwapChain;
 
     // Data
     PointData origin;
+    bool frozen;
+    Metric metric;
 
 public:
 
     // Constructor
-    KDTree() :
-        origin(nullptr)
+    explicit KDTree(const Metric & metric = Metric(), const Allocator & allocator = Allocator()) :
+        pointDataVector(allocator),
+        indexedPointData(allocator),
+        nodeFloor(allocator),
+        lowerIndex(allocator),
+        upperIndex(allocator),
+        parentIndex(allocator),
+        boundaries(allocator),
+        balanceByIndex(allocator),
+        indexByBalanceAndFloor(allocator),
+        subtreeSizeByIndex(allocator),
+        coordinateSumByIndex(allocator),
+        frozenNodes(allocator),
+        frozenCoordinateSums(allocator),
+        frozenErasedCount(0),
+        insertPath(allocator),
+        eraseSwapChain(allocator),
+        origin(nullptr),
+        frozen(false),
+        metric(metric)
     {
     }
 
@@ -126,7 +217,7 @@ private:
         nodeFloor[indexedPointData[child]] = nodeFloor[indexedPointData[parent]] + 1;
     }
 
-    void UpdateBoundaries(const std::vector<PointData> & updateList, PointData point)
+    void UpdateBoundaries(const Vector<PointData> & updateList, PointData point)
     {
         gbiAssert(indexedPointData.find(point) != indexedPointData.end() && "Boundary not found in KDTree");
 
@@ -222,8 +313,11 @@ private:
 
             for (size_t i = 0; i < Dimension; ++i)
             {
-                boundariesSlot[2 * i] = other;
-                boundariesSlot[2 * i + 1] = other;
+                if (!insertedSomething || PointWrapper(other).Get(i) < PointWrapper(boundariesSlot[2 * i]).Get(i))
+                    boundariesSlot[2 * i] = other;
+
+                if (!insertedSomething || PointWrapper(boundariesSlot[2 * i + 1]).Get(i) < PointWrapper(other).Get(i))
+                    boundariesSlot[2 * i + 1] = other;
             }
 
             if (boundaries.find(other) != boundaries.end())
@@ -248,9 +342,6 @@ private:
 
     void UpdateBoundaries(SizeT pointIndex)
     {
-        if (boundaries.find(pointDataVector.at(pointIndex)) != boundaries.end())
-            boundaries.erase(pointDataVector.at(pointIndex));
-
         PointData lowerPoint = lowerIndex.find(pointIndex) != lowerIndex.end() ? pointDataVector.at(lowerIndex[pointIndex]) : nullptr;
         PointData upperPoint = upperIndex.find(pointIndex) != upperIndex.end() ? pointDataVector.at(upperIndex[pointIndex]) : nullptr;
 
@@ -260,8 +351,61 @@ private:
         UpdateBoundariesWithPoint(lowerPoint, boundariesSlot, insertedSomething);
         UpdateBoundariesWithPoint(upperPoint, boundariesSlot, insertedSomething);
 
+        // Overwritten in place rather than erased and inserted again, to spare a node allocation
         if (insertedSomething)
             boundaries[pointDataVector.at(pointIndex)] = boundariesSlot;
+        else
+            boundaries.erase(pointDataVector.at(pointIndex));
+    }
+
+    void AddCoordinates(std::array<double, Dimension> & sum, PointData point)
+    {
+        for (size_t i = 0; i < Dimension; ++i)
+        {
+            sum[i] += PointWrapper(point).Get(i);
+        }
+    }
+
+    void AddCoordinateSum(std::array<double, Dimension> & sum, SizeT pointIndex)
+    {
+        gbiAssert(coordinateSumByIndex.find(pointIndex) != coordinateSumByIndex.end());
+
+        for (size_t i = 0; i < Dimension; ++i)
+        {
+            sum[i] += coordinateSumByIndex[pointIndex][i];
+        }
+    }
+
+    // Recomputes size and coordinate sum of a subtree from its direct children
+    void UpdateSubtreeAggregates(SizeT pointIndex)
+    {
+        SizeT subtreeSize = 1;
+        std::array<double, Dimension> coordinateSum = {};
+
+        if (TrackCoordinateSums)
+            AddCoordinates(coordinateSum, pointDataVector.at(pointIndex));
+
+        if (lowerIndex.find(pointIndex) != lowerIndex.end())
+        {
+            gbiAssert(subtreeSizeByIndex.find(lowerIndex[pointIndex]) != subtreeSizeByIndex.end());
+
+            subtreeSize += subtreeSizeByIndex[lowerIndex[pointIndex]];
+            if (TrackCoordinateSums)
+                AddCoordinateSum(coordinateSum, lowerIndex[pointIndex]);
+        }
+
+        if (upperIndex.find(pointIndex) != upperIndex.end())
+        {
+            gbiAssert(subtreeSizeByIndex.find(upperIndex[pointIndex]) != subtreeSizeByIndex.end());
+
+            subtreeSize += subtreeSizeByIndex[upperIndex[pointIndex]];
+            if (TrackCoordinateSums)
+                AddCoordinateSum(coordinateSum, upperIndex[pointIndex]);
+        }
+
+        subtreeSizeByIndex[pointIndex] = subtreeSize;
+        if (TrackCoordinateSums)
+            coordinateSumByIndex[pointIndex] = coordinateSum;
     }
 
     void MoveLastElementTo(SizeT itemIndex)
@@ -285,10 +429,16 @@ private:
                     gbiAssert(false && "Has parent that doesn't refer item as child");
             }
 
+            if (lowerIndex.find(lastIndex) != lowerIndex.end())
+                parentIndex[lowerIndex[lastIndex]] = itemIndex;
+
+            if (upperIndex.find(lastIndex) != upperIndex.end())
+                parentIndex[upperIndex[lastIndex]] = itemIndex;
+
             if (balanceByIndex.find(lastIndex) != balanceByIndex.end())
             {
                 balanceByIndex[itemIndex] = balanceByIndex[lastIndex];
-                indexByBalanceAndFloor[balanceByIndex[lastIndex]][nodeFloor[itemIndex]].insert(itemIndex);
+                indexByBalanceAndFloor[balanceByIndex[lastIndex]][nodeFloor[lastIndex]].insert(itemIndex);
             }
             else
             {
@@ -331,6 +481,12 @@ private:
             boundaries.erase(pointDataVector.at(itemIndex));
             //}
 
+            gbiAssert(subtreeSizeByIndex.find(lastIndex) != subtreeSizeByIndex.end());
+
+            subtreeSizeByIndex[itemIndex] = subtreeSizeByIndex[lastIndex];
+            if (TrackCoordinateSums)
+                coordinateSumByIndex[itemIndex] = coordinateSumByIndex[lastIndex];
+
             gbiAssert(nodeFloor.find(lastIndex) != nodeFloor.end());
 
             nodeFloor[itemIndex] = nodeFloor[lastIndex];
@@ -338,20 +494,14 @@ private:
             indexedPointData[pointDataVector.at(lastIndex)] = itemIndex;
         }
 
-        indexByBalanceAndFloor[balanceByIndex[lastIndex]][nodeFloor[lastIndex]].erase(lastIndex);
-        if (indexByBalanceAndFloor[balanceByIndex[lastIndex]][nodeFloor[lastIndex]].size() == 0)
-        {
-            indexByBalanceAndFloor[balanceByIndex[lastIndex]].erase(nodeFloor[lastIndex]);
-            if (indexByBalanceAndFloor[balanceByIndex[lastIndex]].size() == 0)
-            {
-                indexByBalanceAndFloor.erase(balanceByIndex[lastIndex]);
-            }
-        }
+        InternalRemoveBalancePriority(lastIndex);
         balanceByIndex.erase(lastIndex);
 
         pointDataVector.resize(pointDataVector.size() - 1);
         indexedPointData.erase(previousDataAtLocation);
         nodeFloor.erase(lastIndex);
+        subtreeSizeByIndex.erase(lastIndex);
+        coordinateSumByIndex.erase(lastIndex);
         lowerIndex.erase(lastIndex);
         upperIndex.erase(lastIndex);
         parentIndex.erase(lastIndex);
@@ -409,6 +559,8 @@ private:
 
         nodeFloor.erase(pointIndex);
         parentIndex.erase(pointIndex);
+        subtreeSizeByIndex.erase(pointIndex);
+        coordinateSumByIndex.erase(pointIndex);
 
         MoveLastElementTo(pointIndex);
 
@@ -461,11 +613,11 @@ private:
 
             result = lowerIndex[index];
 
-            if (boundaries.find(pointDataVector.at(lowerIndex[index])) != boundaries.end() && HasHigherCoordinate(dim, boundaries[pointDataVector.at(lowerIndex[index])][dim * 2], result))
+            if (boundaries.find(pointDataVector.at(lowerIndex[index])) != boundaries.end() && HasHigherCoordinate(dim, boundaries[pointDataVector.at(lowerIndex[index])][dim * 2 + 1], result))
             {
-                gbiAssert(indexedPointData.find(boundaries[pointDataVector.at(lowerIndex[index])][dim * 2]) != indexedPointData.end());
+                gbiAssert(indexedPointData.find(boundaries[pointDataVector.at(lowerIndex[index])][dim * 2 + 1]) != indexedPointData.end());
 
-                result = indexedPointData[boundaries[pointDataVector.at(lowerIndex[index])][dim * 2]];
+                result = indexedPointData[boundaries[pointDataVector.at(lowerIndex[index])][dim * 2 + 1]];
             }
         }
         else
@@ -493,35 +645,633 @@ private:
         if (pointDataVector[dst] == origin)
             origin = pointDataVector[src];
 
-        boundaries.erase(pointDataVector[dst]);
-        boundaries.erase(pointDataVector[src]);
+        // Boundaries belong to the node location: when both points have some, swapping them keeps the
+        // map nodes alive until the caller refreshes their content
+        auto dstBoundaries = boundaries.find(pointDataVector[dst]);
+        auto srcBoundaries = boundaries.find(pointDataVector[src]);
+        if (dstBoundaries != boundaries.end() && srcBoundaries != boundaries.end())
+        {
+            std::swap(dstBoundaries->second, srcBoundaries->second);
+        }
+        else
+        {
+            boundaries.erase(pointDataVector[dst]);
+            boundaries.erase(pointDataVector[src]);
+        }
 
+        // Subtree sizes only depend on the structure, coordinate sums are refreshed by the caller
+        // on its way back up to origin
         std::swap(pointDataVector[dst], pointDataVector[src]);
         std::swap(indexedPointData[pointDataVector[dst]], indexedPointData[pointDataVector[src]]);
     }
 
+    bool IsInRange(UInt dim, PointData point, PointData lowerCorner, PointData upperCorner)
+    {
+        return !(PointWrapper(point).Get(dim) < PointWrapper(lowerCorner).Get(dim)) &&
+            !(PointWrapper(upperCorner).Get(dim) < PointWrapper(point).Get(dim));
+    }
+
+    bool IsInRange(PointData point, PointData lowerCorner, PointData upperCorner)
+    {
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            if (!IsInRange(i, point, lowerCorner, upperCorner))
+                return false;
+        }
+
+        return true;
+    }
+
+    // Subtree AABB is the node itself extended by the boundaries of its descendants
+    bool IsSubtreeInRange(SizeT pointIndex, PointData lowerCorner, PointData upperCorner)
+    {
+        PointData point = pointDataVector.at(pointIndex);
+
+        if (!IsInRange(point, lowerCorner, upperCorner))
+            return false;
+
+        if (boundaries.find(point) != boundaries.end())
+        {
+            for (UInt i = 0; i < Dimension; ++i)
+            {
+                if (!IsInRange(i, boundaries[point][2 * i], lowerCorner, upperCorner) ||
+                    !IsInRange(i, boundaries[point][2 * i + 1], lowerCorner, upperCorner))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool IsSubtreeOutOfRange(SizeT pointIndex, PointData lowerCorner, PointData upperCorner)
+    {
+        PointData point = pointDataVector.at(pointIndex);
+        bool hasBoundaries = boundaries.find(point) != boundaries.end();
+
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            PointData lowest = point;
+            PointData highest = point;
+
+            if (hasBoundaries)
+            {
+                if (PointWrapper(boundaries[point][2 * i]).Get(i) < PointWrapper(lowest).Get(i))
+                    lowest = boundaries[point][2 * i];
+
+                if (PointWrapper(highest).Get(i) < PointWrapper(boundaries[point][2 * i + 1]).Get(i))
+                    highest = boundaries[point][2 * i + 1];
+            }
+
+            if (PointWrapper(highest).Get(i) < PointWrapper(lowerCorner).Get(i) || PointWrapper(upperCorner).Get(i) < PointWrapper(lowest).Get(i))
+                return true;
+        }
+
+        return false;
+    }
+
+    SizeT RangeAggregateInternal(SizeT pointIndex, PointData lowerCorner, PointData upperCorner, std::array<double, Dimension> * coordinateSum)
+    {
+        if (IsSubtreeOutOfRange(pointIndex, lowerCorner, upperCorner))
+            return 0;
+
+        if (IsSubtreeInRange(pointIndex, lowerCorner, upperCorner))
+        {
+            gbiAssert(subtreeSizeByIndex.find(pointIndex) != subtreeSizeByIndex.end());
+
+            if (coordinateSum != nullptr)
+                AddCoordinateSum(*coordinateSum, pointIndex);
+
+            return subtreeSizeByIndex[pointIndex];
+        }
+
+        SizeT count = 0;
+
+        if (IsInRange(pointDataVector.at(pointIndex), lowerCorner, upperCorner))
+        {
+            ++count;
+
+            if (coordinateSum != nullptr)
+                AddCoordinates(*coordinateSum, pointDataVector.at(pointIndex));
+        }
+
+        if (lowerIndex.find(pointIndex) != lowerIndex.end())
+            count += RangeAggregateInternal(lowerIndex[pointIndex], lowerCorner, upperCorner, coordinateSum);
+
+        if (upperIndex.find(pointIndex) != upperIndex.end())
+            count += RangeAggregateInternal(upperIndex[pointIndex], lowerCorner, upperCorner, coordinateSum);
+
+        return count;
+    }
+
+    SizeT FrozenRangeAggregateInternal(
+        SizeT nodeIndex,
+        const std::array<Coordinate, Dimension> & lowerCorner,
+        const std::array<Coordinate, Dimension> & upperCorner,
+        std::array<double, Dimension> * coordinateSum) const
+    {
+        const FrozenNode & node = frozenNodes[nodeIndex];
+
+        if (node.subtreeSize == 0)
+            return 0;
+
+        bool subtreeInRange = true;
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            if (node.highestCoordinates[i] < lowerCorner[i] || upperCorner[i] < node.lowestCoordinates[i])
+                return 0;
+
+            if (node.lowestCoordinates[i] < lowerCorner[i] || upperCorner[i] < node.highestCoordinates[i])
+                subtreeInRange = false;
+        }
+
+        if (subtreeInRange)
+        {
+            if (coordinateSum != nullptr)
+            {
+                for (UInt i = 0; i < Dimension; ++i)
+                {
+                    (*coordinateSum)[i] += frozenCoordinateSums[nodeIndex][i];
+                }
+            }
+
+            return node.subtreeSize;
+        }
+
+        SizeT count = 0;
+
+        bool pointInRange = !node.erased;
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            if (node.coordinates[i] < lowerCorner[i] || upperCorner[i] < node.coordinates[i])
+                pointInRange = false;
+        }
+
+        if (pointInRange)
+        {
+            ++count;
+
+            if (coordinateSum != nullptr)
+            {
+                for (UInt i = 0; i < Dimension; ++i)
+                {
+                    (*coordinateSum)[i] += node.coordinates[i];
+                }
+            }
+        }
+
+        if (node.lower != 0)
+            count += FrozenRangeAggregateInternal(node.lower, lowerCorner, upperCorner, coordinateSum);
+
+        if (node.upper != 0)
+            count += FrozenRangeAggregateInternal(node.upper, lowerCorner, upperCorner, coordinateSum);
+
+        return count;
+    }
+
+    SizeT RangeAggregateDispatch(PointData lowerCorner, PointData upperCorner, std::array<double, Dimension> * coordinateSum)
+    {
+        if (origin == nullptr)
+            return 0;
+
+        if (frozen)
+        {
+            std::array<Coordinate, Dimension> lowerCoordinates;
+            std::array<Coordinate, Dimension> upperCoordinates;
+
+            for (UInt i = 0; i < Dimension; ++i)
+            {
+                lowerCoordinates[i] = PointWrapper(lowerCorner).Get(i);
+                upperCoordinates[i] = PointWrapper(upperCorner).Get(i);
+            }
+
+            return FrozenRangeAggregateInternal(0, lowerCoordinates, upperCoordinates, coordinateSum);
+        }
+
+        gbiAssert(indexedPointData.find(origin) != indexedPointData.end());
+
+        return RangeAggregateInternal(indexedPointData[origin], lowerCorner, upperCorner, coordinateSum);
+    }
+
+    // childOf(index, upper, child) sets child to the lower or upper child of index, and returns false
+    // when there is none. It lets the layout walk either the dynamic or the frozen structure.
+    template<typename ChildOf>
+    static void CollectDescendantsAtDepth(SizeT index, UInt depth, ChildOf childOf, Vector<SizeT> & descendants)
+    {
+        if (depth == 0)
+        {
+            descendants.push_back(index);
+        }
+        else
+        {
+            SizeT child;
+
+            if (childOf(index, false, child))
+                CollectDescendantsAtDepth(child, depth - 1, childOf, descendants);
+
+            if (childOf(index, true, child))
+                CollectDescendantsAtDepth(child, depth - 1, childOf, descendants);
+        }
+    }
+
+    // Lays out the top half of the levels first, then each subtree hanging below it, recursively.
+    // Every node ends up before its descendants.
+    template<typename ChildOf>
+    static void VanEmdeBoasLayout(SizeT index, UInt height, ChildOf childOf, Vector<SizeT> & layout)
+    {
+        gbiAssert(height > 0);
+
+        if (height == 1)
+        {
+            layout.push_back(index);
+        }
+        else
+        {
+            UInt topHeight = height / 2;
+
+            VanEmdeBoasLayout(index, topHeight, childOf, layout);
+
+            Vector<SizeT> bottomRoots(layout.get_allocator());
+            CollectDescendantsAtDepth(index, topHeight, childOf, bottomRoots);
+
+            for (auto bottomRoot : bottomRoots)
+            {
+                VanEmdeBoasLayout(bottomRoot, height - topHeight, childOf, layout);
+            }
+        }
+    }
+
+    // Moves frozen node layout[i] to position i
+    void ReorderFrozenNodes(const Vector<SizeT> & layout)
+    {
+        gbiAssert(layout.size() == frozenNodes.size());
+
+        Vector<SizeT> layoutPosition(layout.size(), 0, frozenNodes.get_allocator());
+        for (SizeT i = 0; i < layout.size(); ++i)
+        {
+            layoutPosition[layout[i]] = i;
+        }
+
+        Vector<FrozenNode> reorderedNodes(frozenNodes.get_allocator());
+        Vector<std::array<double, Dimension>> reorderedCoordinateSums(frozenCoordinateSums.get_allocator());
+
+        reorderedNodes.reserve(layout.size());
+        if (TrackCoordinateSums)
+            reorderedCoordinateSums.reserve(layout.size());
+
+        for (auto nodeIndex : layout)
+        {
+            reorderedNodes.push_back(frozenNodes[nodeIndex]);
+
+            FrozenNode & node = reorderedNodes.back();
+            node.lower = node.lower != 0 ? layoutPosition[node.lower] : 0;
+            node.upper = node.upper != 0 ? layoutPosition[node.upper] : 0;
+
+            if (TrackCoordinateSums)
+                reorderedCoordinateSums.push_back(frozenCoordinateSums[nodeIndex]);
+        }
+
+        frozenNodes.swap(reorderedNodes);
+        frozenCoordinateSums.swap(reorderedCoordinateSums);
+    }
+
+    template<typename Container>
+    static void Release(Container & container)
+    {
+        Container(container.get_allocator()).swap(container);
+    }
+
+    void ReleaseDynamicStorage()
+    {
+        Release(pointDataVector);
+        Release(indexedPointData);
+        Release(nodeFloor);
+        Release(lowerIndex);
+        Release(upperIndex);
+        Release(parentIndex);
+        Release(boundaries);
+        Release(balanceByIndex);
+        Release(indexByBalanceAndFloor);
+        Release(subtreeSizeByIndex);
+        Release(coordinateSumByIndex);
+        Release(insertPath);
+        Release(eraseSwapChain);
+    }
+
+    std::array<double, Dimension> GetCoordinates(PointData point) const
+    {
+        std::array<double, Dimension> coordinates;
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            coordinates[i] = PointWrapper(point).Get(i);
+        }
+
+        return coordinates;
+    }
+
+    double SubtreeDistance(SizeT pointIndex, const std::array<double, Dimension> & query)
+    {
+        PointData point = pointDataVector.at(pointIndex);
+        std::array<double, Dimension> lowestCoordinates = GetCoordinates(point);
+        std::array<double, Dimension> highestCoordinates = lowestCoordinates;
+
+        if (boundaries.find(point) != boundaries.end())
+        {
+            for (UInt i = 0; i < Dimension; ++i)
+            {
+                lowestCoordinates[i] = std::min(lowestCoordinates[i], double(PointWrapper(boundaries[point][2 * i]).Get(i)));
+                highestCoordinates[i] = std::max(highestCoordinates[i], double(PointWrapper(boundaries[point][2 * i + 1]).Get(i)));
+            }
+        }
+
+        return BoxDistance(metric, query, lowestCoordinates, highestCoordinates);
+    }
+
+    void NearestInternal(SizeT pointIndex, const std::array<double, Dimension> & query, PointData & nearest, double & nearestDistance)
+    {
+        PointData point = pointDataVector.at(pointIndex);
+        double distance = PointDistance(metric, query, GetCoordinates(point));
+
+        if (distance < nearestDistance)
+        {
+            nearest = point;
+            nearestDistance = distance;
+        }
+
+        bool hasLower = lowerIndex.find(pointIndex) != lowerIndex.end();
+        bool hasUpper = upperIndex.find(pointIndex) != upperIndex.end();
+        double lowerDistance = hasLower ? SubtreeDistance(lowerIndex[pointIndex], query) : nearestDistance;
+        double upperDistance = hasUpper ? SubtreeDistance(upperIndex[pointIndex], query) : nearestDistance;
+
+        // Closest subtree first, the other one is likely to be pruned afterwards
+        if (lowerDistance <= upperDistance)
+        {
+            if (lowerDistance < nearestDistance)
+                NearestInternal(lowerIndex[pointIndex], query, nearest, nearestDistance);
+            if (upperDistance < nearestDistance)
+                NearestInternal(upperIndex[pointIndex], query, nearest, nearestDistance);
+        }
+        else
+        {
+            if (upperDistance < nearestDistance)
+                NearestInternal(upperIndex[pointIndex], query, nearest, nearestDistance);
+            if (lowerDistance < nearestDistance)
+                NearestInternal(lowerIndex[pointIndex], query, nearest, nearestDistance);
+        }
+    }
+
+    void FrozenNearestInternal(SizeT nodeIndex, const std::array<double, Dimension> & query, PointData & nearest, double & nearestDistance) const
+    {
+        const FrozenNode & node = frozenNodes[nodeIndex];
+        double distance = node.erased ? std::numeric_limits<double>::infinity() : PointDistance(metric, query, node.coordinates);
+
+        if (distance < nearestDistance)
+        {
+            nearest = node.point;
+            nearestDistance = distance;
+        }
+
+        // Subtrees left without points are skipped like missing ones
+        double lowerDistance = node.lower != 0 && frozenNodes[node.lower].subtreeSize > 0 ?
+            BoxDistance(metric, query, frozenNodes[node.lower].lowestCoordinates, frozenNodes[node.lower].highestCoordinates) :
+            nearestDistance;
+        double upperDistance = node.upper != 0 && frozenNodes[node.upper].subtreeSize > 0 ?
+            BoxDistance(metric, query, frozenNodes[node.upper].lowestCoordinates, frozenNodes[node.upper].highestCoordinates) :
+            nearestDistance;
+
+        if (lowerDistance <= upperDistance)
+        {
+            if (lowerDistance < nearestDistance)
+                FrozenNearestInternal(node.lower, query, nearest, nearestDistance);
+            if (upperDistance < nearestDistance)
+                FrozenNearestInternal(node.upper, query, nearest, nearestDistance);
+        }
+        else
+        {
+            if (upperDistance < nearestDistance)
+                FrozenNearestInternal(node.upper, query, nearest, nearestDistance);
+            if (lowerDistance < nearestDistance)
+                FrozenNearestInternal(node.lower, query, nearest, nearestDistance);
+        }
+    }
+
+    bool FrozenContainsInternal(SizeT nodeIndex, PointData point, const std::array<Coordinate, Dimension> & coordinates) const
+    {
+        const FrozenNode & node = frozenNodes[nodeIndex];
+
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            if (coordinates[i] < node.lowestCoordinates[i] || node.highestCoordinates[i] < coordinates[i])
+                return false;
+        }
+
+        return (node.point == point && !node.erased) ||
+            (node.lower != 0 && FrozenContainsInternal(node.lower, point, coordinates)) ||
+            (node.upper != 0 && FrozenContainsInternal(node.upper, point, coordinates));
+    }
+
+    // Marks the node holding point as erased and takes it out of the sizes and sums of the subtrees
+    // containing it. Boxes are left as they are, they still bound the remaining points.
+    bool FrozenEraseInternal(SizeT nodeIndex, PointData point, const std::array<Coordinate, Dimension> & coordinates)
+    {
+        FrozenNode & node = frozenNodes[nodeIndex];
+
+        if (node.subtreeSize == 0)
+            return false;
+
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            if (coordinates[i] < node.lowestCoordinates[i] || node.highestCoordinates[i] < coordinates[i])
+                return false;
+        }
+
+        bool found = node.point == point && !node.erased;
+        if (found)
+            node.erased = true;
+
+        found = found ||
+            (node.lower != 0 && FrozenEraseInternal(node.lower, point, coordinates)) ||
+            (node.upper != 0 && FrozenEraseInternal(node.upper, point, coordinates));
+
+        if (found)
+        {
+            --node.subtreeSize;
+
+            if (TrackCoordinateSums)
+            {
+                for (UInt i = 0; i < Dimension; ++i)
+                {
+                    frozenCoordinateSums[nodeIndex][i] -= coordinates[i];
+                }
+            }
+        }
+
+        return found;
+    }
+
+    // Erase on the frozen layout. Once half of the nodes are erased, the remaining points are built
+    // into a new layout.
+    void FrozenErase(PointData point)
+    {
+        if (point == nullptr || frozenNodes.empty())
+            return;
+
+        std::array<Coordinate, Dimension> coordinates;
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            coordinates[i] = PointWrapper(point).Get(i);
+        }
+
+        if (FrozenEraseInternal(0, point, coordinates))
+        {
+            ++frozenErasedCount;
+
+            if (2 * frozenErasedCount >= frozenNodes.size())
+                BuildFromFrozenNodes();
+        }
+    }
+
+    void BuildFromFrozenNodes()
+    {
+        Vector<PointData> points(frozenNodes.get_allocator());
+        points.reserve(Size());
+
+        ForEachPoint([&points](PointData point)
+        {
+            points.push_back(point);
+        });
+
+        BuildInternal(points);
+    }
+
+    // Nodes are built in preorder, then moved to van Emde Boas order as Freeze would lay them out.
+    // points is reordered.
+    void BuildInternal(Vector<PointData> & points)
+    {
+        ReleaseDynamicStorage();
+        Release(frozenNodes);
+        Release(frozenCoordinateSums);
+        frozenErasedCount = 0;
+
+        points.erase(std::remove(points.begin(), points.end(), nullptr), points.end());
+
+        frozenNodes.reserve(points.size());
+        if (TrackCoordinateSums)
+            frozenCoordinateSums.reserve(points.size());
+
+        origin = nullptr;
+        if (!points.empty())
+        {
+            BuildFrozenSubtree(points.begin(), points.end(), 0);
+
+            // Median splits give floor(log2(size)) + 1 floors
+            UInt height = 0;
+            for (SizeT size = points.size(); size > 0; size /= 2)
+            {
+                ++height;
+            }
+
+            auto childOf = [this](SizeT nodeIndex, bool upper, SizeT & child) -> bool
+            {
+                child = upper ? frozenNodes[nodeIndex].upper : frozenNodes[nodeIndex].lower;
+                return child != 0;
+            };
+
+            Vector<SizeT> layout(frozenNodes.get_allocator());
+            layout.reserve(frozenNodes.size());
+            VanEmdeBoasLayout(0, height, childOf, layout);
+
+            ReorderFrozenNodes(layout);
+
+            origin = frozenNodes[0].point;
+        }
+
+        frozen = true;
+    }
+
+    // Median split on floor % Dimension, as Insert would do on a perfectly balanced tree.
+    // frozenNodes must have been reserved beforehand so that nodes don't move while building.
+    SizeT BuildFrozenSubtree(typename Vector<PointData>::iterator first, typename Vector<PointData>::iterator last, UInt floor)
+    {
+        gbiAssert(first < last);
+        gbiAssert(frozenNodes.size() < frozenNodes.capacity());
+
+        UInt dim = floor % Dimension;
+        auto median = first + (last - first) / 2;
+
+        std::nth_element(first, median, last, [dim](PointData p1, PointData p2)
+        {
+            return PointWrapper(p1).Get(dim) < PointWrapper(p2).Get(dim);
+        });
+
+        SizeT nodeIndex = frozenNodes.size();
+        frozenNodes.push_back(FrozenNode());
+        if (TrackCoordinateSums)
+            frozenCoordinateSums.push_back(std::array<double, Dimension>());
+
+        SizeT lower = first < median ? BuildFrozenSubtree(first, median, floor + 1) : 0;
+        SizeT upper = median + 1 < last ? BuildFrozenSubtree(median + 1, last, floor + 1) : 0;
+
+        FrozenNode & node = frozenNodes[nodeIndex];
+        node.point = *median;
+        node.lower = lower;
+        node.upper = upper;
+        node.erased = false;
+        node.subtreeSize = 1 + (lower != 0 ? frozenNodes[lower].subtreeSize : 0) + (upper != 0 ? frozenNodes[upper].subtreeSize : 0);
+
+        std::array<SizeT, 2> children = {{ lower, upper }};
+
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            node.coordinates[d] = PointWrapper(node.point).Get(d);
+            node.lowestCoordinates[d] = node.coordinates[d];
+            node.highestCoordinates[d] = node.coordinates[d];
+
+            if (TrackCoordinateSums)
+                frozenCoordinateSums[nodeIndex][d] = node.coordinates[d];
+
+            for (auto child : children)
+            {
+                if (child != 0)
+                {
+                    node.lowestCoordinates[d] = std::min(node.lowestCoordinates[d], frozenNodes[child].lowestCoordinates[d]);
+                    node.highestCoordinates[d] = std::max(node.highestCoordinates[d], frozenNodes[child].highestCoordinates[d]);
+
+                    if (TrackCoordinateSums)
+                        frozenCoordinateSums[nodeIndex][d] += frozenCoordinateSums[child][d];
+                }
+            }
+        }
+
+        return nodeIndex;
+    }
+
 public:
 
     void Insert(PointData point)
     {
+        Thaw();
+
         if (point != nullptr)
         {
             PointData parent = nullptr;
             PointData current = origin;
             UInt dim = 0;
 
-            std::vector<PointData> updateList;
+            insertPath.clear();
 
             bool upper = false;
             while (current != nullptr)
             {
-                updateList.push_back(current);
+                insertPath.push_back(current);
                 parent = current;
 
                 PointWrapper insertedPoint(point);
                 PointWrapper currentPoint(current);
 
-                if (insertedPoint.Get(dim) < currentPoint.Get(dim) || (insertedPoint.Get(dim) == currentPoint.Get(dim) && balanceByIndex[indexedPointData[current]] > 0))
+                // Leaves have no balance yet, don't create one just to read it
+                auto currentBalance = balanceByIndex.find(indexedPointData[current]);
+
+                if (insertedPoint.Get(dim) < currentPoint.Get(dim) || (insertedPoint.Get(dim) == currentPoint.Get(dim) && currentBalance != balanceByIndex.end() && currentBalance->second > 0))
                 {
                     upper = false;
                     current = GetLower(current);
@@ -534,11 +1284,16 @@ public:
 
                 UpdateBalance(parent, upper);
 
+                ++subtreeSizeByIndex[indexedPointData[parent]];
+                if (TrackCoordinateSums)
+                    AddCoordinates(coordinateSumByIndex[indexedPointData[parent]], point);
+
                 dim = (dim + 1) % Dimension;
             }
 
-            InsertInternal(point);
-            UpdateBoundaries(updateList, point);
+            SizeT pointIndex = InsertInternal(point);
+            UpdateBoundaries(insertPath, point);
+            UpdateSubtreeAggregates(pointIndex);
 
             if (parent != nullptr)
             {
@@ -561,38 +1316,45 @@ public:
         }
     }
 
+    // Erasing from a frozen tree keeps it frozen, see FrozenErase. Points not in the tree are ignored.
     void Erase(PointData point)
     {
         PointData newLeaf = nullptr;
         bool incrementNewLeafBalance = false;
 
-        if (indexedPointData.find(point) != indexedPointData.end())
+        if (frozen)
         {
-            SizeT pointIndex = indexedPointData[point];
+            FrozenErase(point);
+            return;
+        }
 
-            std::vector<SizeT> swapChain;
-            SizeT current = pointIndex;
+        if (indexedPointData.find(point) == indexedPointData.end())
+            return;
 
-            while (!IsLeaf(current))
-            {
-                swapChain.push_back(current);
-                current = GetBestReplacementCandidate(current);
-            }
-            swapChain.push_back(current);
+        SizeT pointIndex = indexedPointData[point];
 
-            gbiAssert(swapChain.size() > 0);
+        eraseSwapChain.clear();
+        SizeT current = pointIndex;
 
-            auto it1 = swapChain.begin();
-            auto it2 = it1;
-            ++it2;
-            for (; it2 != swapChain.end(); ++it1, ++it2)
-            {
-                SwapNodes(*it1, *it2);
-            }
+        while (!IsLeaf(current))
+        {
+            eraseSwapChain.push_back(current);
+            current = GetBestReplacementCandidate(current);
+        }
+        eraseSwapChain.push_back(current);
+
+        gbiAssert(eraseSwapChain.size() > 0);
 
-            newLeaf = RemoveLeaf(*swapChain.rbegin(), incrementNewLeafBalance);
+        auto it1 = eraseSwapChain.begin();
+        auto it2 = it1;
+        ++it2;
+        for (; it2 != eraseSwapChain.end(); ++it1, ++it2)
+        {
+            SwapNodes(*it1, *it2);
         }
 
+        newLeaf = RemoveLeaf(*eraseSwapChain.rbegin(), incrementNewLeafBalance);
+
         if (newLeaf != nullptr)
         {
             gbiAssert(indexedPointData.find(newLeaf) != indexedPointData.end());
@@ -607,6 +1369,7 @@ public:
                 PointData parent = GetParent(current);
 
                 UpdateBoundaries(indexedPointData[current]);
+                UpdateSubtreeAggregates(indexedPointData[current]);
 
                 if (parent != nullptr)
                 {
@@ -640,11 +1403,329 @@ public:
             gbiAssert(boundaries.size() == 0);
             gbiAssert(balanceByIndex.size() == 0);
             gbiAssert(indexByBalanceAndFloor.size() == 0);
+            gbiAssert(subtreeSizeByIndex.size() == 0);
+            gbiAssert(coordinateSumByIndex.size() == 0);
 
             origin = nullptr;
         }
     }
 
+    SizeT Size() const
+    {
+        return frozen ? frozenNodes.size() - frozenErasedCount : pointDataVector.size();
+    }
+
+    // Pre-sizes the dynamic storage for size points, so that updates below that size don't rehash
+    void Reserve(SizeT size)
+    {
+        pointDataVector.reserve(size);
+        indexedPointData.reserve(size);
+        nodeFloor.reserve(size);
+        lowerIndex.reserve(size);
+        upperIndex.reserve(size);
+        parentIndex.reserve(size);
+        boundaries.reserve(size);
+        balanceByIndex.reserve(size);
+        subtreeSizeByIndex.reserve(size);
+        if (TrackCoordinateSums)
+            coordinateSumByIndex.reserve(size);
+    }
+
+    // Calls visitor(PointData) once for every point, in storage order
+    template<typename Visitor>
+    void ForEachPoint(Visitor visitor) const
+    {
+        if (frozen)
+        {
+            for (auto & node : frozenNodes)
+            {
+                if (!node.erased)
+                    visitor(node.point);
+            }
+        }
+        else
+        {
+            for (auto point : pointDataVector)
+            {
+                visitor(point);
+            }
+        }
+    }
+
+    // Counts points inside the closed box [lowerCorner, upperCorner]
+    SizeT RangeCount(PointData lowerCorner, PointData upperCorner)
+    {
+        return RangeAggregateDispatch(lowerCorner, upperCorner, nullptr);
+    }
+
+    // Same as RangeCount, also accumulating the coordinates of the points found into coordinateSum
+    SizeT RangeAggregate(PointData lowerCorner, PointData upperCorner, std::array<double, Dimension> & coordinateSum)
+    {
+        static_assert(TrackCoordinateSums, "RangeAggregate requires TrackCoordinateSums");
+
+        coordinateSum.fill(0.);
+
+        return RangeAggregateDispatch(lowerCorner, upperCorner, &coordinateSum);
+    }
+
+    bool IsFrozen() const
+    {
+        return frozen;
+    }
+
+    // Distance between two points according to Metric
+    double Distance(PointData point1, PointData point2) const
+    {
+        return PointDistance(metric, GetCoordinates(point1), GetCoordinates(point2));
+    }
+
+    // Closest point to query according to Metric, nullptr if the tree is empty. A point of the tree
+    // is its own nearest neighbor.
+    PointData Nearest(PointData query)
+    {
+        double nearestDistance;
+
+        return Nearest(query, nearestDistance);
+    }
+
+    // Same as Nearest, also giving the distance to the point found
+    PointData Nearest(PointData query, double & nearestDistance)
+    {
+        return Nearest(query, std::numeric_limits<double>::infinity(), nearestDistance);
+    }
+
+    // Closest point to query among those closer than bound, nullptr if there is none. nearestDistance
+    // is set to the distance to the point found, or to bound. Searches over several trees pass the
+    // best distance found so far, so that each tree prunes with it from the root.
+    PointData Nearest(PointData query, double bound, double & nearestDistance)
+    {
+        PointData nearest = nullptr;
+        nearestDistance = bound;
+
+        if (origin != nullptr)
+        {
+            std::array<double, Dimension> queryCoordinates = GetCoordinates(query);
+
+            if (frozen)
+            {
+                const FrozenNode & root = frozenNodes[0];
+
+                if (root.subtreeSize > 0 && BoxDistance(metric, queryCoordinates, root.lowestCoordinates, root.highestCoordinates) < nearestDistance)
+                    FrozenNearestInternal(0, queryCoordinates, nearest, nearestDistance);
+            }
+            else
+            {
+                gbiAssert(indexedPointData.find(origin) != indexedPointData.end());
+
+                SizeT originIndex = indexedPointData[origin];
+
+                if (SubtreeDistance(originIndex, queryCoordinates) < nearestDistance)
+                    NearestInternal(originIndex, queryCoordinates, nearest, nearestDistance);
+            }
+        }
+
+        return nearest;
+    }
+
+    bool Contains(PointData point) const
+    {
+        if (point == nullptr || origin == nullptr)
+            return false;
+
+        if (frozen)
+        {
+            std::array<Coordinate, Dimension> coordinates;
+            for (UInt i = 0; i < Dimension; ++i)
+            {
+                coordinates[i] = PointWrapper(point).Get(i);
+            }
+
+            return FrozenContainsInternal(0, point, coordinates);
+        }
+
+        return indexedPointData.find(point) != indexedPointData.end();
+    }
+
+    // Replaces the content of the tree with a perfectly balanced one holding the points in
+    // [first, last), built directly in the frozen layout
+    template<typename Iterator>
+    void Build(Iterator first, Iterator last)
+    {
+        Vector<PointData> points(first, last, pointDataVector.get_allocator());
+
+        BuildInternal(points);
+    }
+
+    // Moves the tree to a read-only layout where nodes are stored contiguously in van Emde Boas order
+    // and all storage is shrunk to fit. Queries and Erase run on that layout until Thaw, which Insert
+    // calls on its own. On a frozen tree, drops the nodes erased since it was laid out.
+    void Freeze()
+    {
+        if (frozen)
+        {
+            if (frozenErasedCount > 0)
+                BuildFromFrozenNodes();
+
+            return;
+        }
+
+        Vector<SizeT> layout(pointDataVector.get_allocator());
+        layout.reserve(pointDataVector.size());
+
+        if (origin != nullptr)
+        {
+            gbiAssert(indexedPointData.find(origin) != indexedPointData.end());
+
+            UInt height = 0;
+            for (auto & floor : nodeFloor)
+            {
+                height = std::max(height, floor.second + 1);
+            }
+
+            auto childOf = [this](SizeT pointIndex, bool upper, SizeT & child) -> bool
+            {
+                const UnorderedMap<SizeT, SizeT> & children = upper ? upperIndex : lowerIndex;
+                auto it = children.find(pointIndex);
+
+                if (it == children.end())
+                    return false;
+
+                child = it->second;
+                return true;
+            };
+
+            VanEmdeBoasLayout(indexedPointData[origin], height, childOf, layout);
+        }
+
+        gbiAssert(layout.size() == pointDataVector.size());
+
+        Vector<SizeT> layoutPosition(pointDataVector.size(), 0, pointDataVector.get_allocator());
+        for (SizeT i = 0; i < layout.size(); ++i)
+        {
+            layoutPosition[layout[i]] = i;
+        }
+
+        frozenNodes.resize(layout.size());
+        if (TrackCoordinateSums)
+            frozenCoordinateSums.resize(layout.size());
+
+        for (SizeT i = 0; i < layout.size(); ++i)
+        {
+            SizeT pointIndex = layout[i];
+            PointData point = pointDataVector.at(pointIndex);
+            FrozenNode & node = frozenNodes[i];
+
+            gbiAssert(subtreeSizeByIndex.find(pointIndex) != subtreeSizeByIndex.end());
+
+            node.point = point;
+            node.lower = lowerIndex.find(pointIndex) != lowerIndex.end() ? layoutPosition[lowerIndex[pointIndex]] : 0;
+            node.upper = upperIndex.find(pointIndex) != upperIndex.end() ? layoutPosition[upperIndex[pointIndex]] : 0;
+            node.subtreeSize = subtreeSizeByIndex[pointIndex];
+            node.erased = false;
+
+            for (UInt d = 0; d < Dimension; ++d)
+            {
+                node.coordinates[d] = PointWrapper(point).Get(d);
+                node.lowestCoordinates[d] = node.coordinates[d];
+                node.highestCoordinates[d] = node.coordinates[d];
+
+                if (boundaries.find(point) != boundaries.end())
+                {
+                    node.lowestCoordinates[d] = std::min(node.lowestCoordinates[d], Coordinate(PointWrapper(boundaries[point][2 * d]).Get(d)));
+                    node.highestCoordinates[d] = std::max(node.highestCoordinates[d], Coordinate(PointWrapper(boundaries[point][2 * d + 1]).Get(d)));
+                }
+            }
+
+            if (TrackCoordinateSums)
+                frozenCoordinateSums[i] = coordinateSumByIndex[pointIndex];
+        }
+
+        frozenNodes.shrink_to_fit();
+        frozenCoordinateSums.shrink_to_fit();
+        frozenErasedCount = 0;
+
+        ReleaseDynamicStorage();
+        frozen = true;
+    }
+
+    // Rebuilds the dynamic structures from the frozen layout, keeping its node order. Erased nodes
+    // are dropped by building a new layout first.
+    void Thaw()
+    {
+        if (!frozen)
+            return;
+
+        if (frozenErasedCount > 0)
+            BuildFromFrozenNodes();
+
+        SizeT size = frozenNodes.size();
+
+        pointDataVector.reserve(size);
+        indexedPointData.reserve(size);
+        nodeFloor.reserve(size);
+        lowerIndex.reserve(size);
+        upperIndex.reserve(size);
+        parentIndex.reserve(size);
+        boundaries.reserve(size);
+        balanceByIndex.reserve(size);
+        subtreeSizeByIndex.reserve(size);
+        if (TrackCoordinateSums)
+            coordinateSumByIndex.reserve(size);
+
+        for (SizeT i = 0; i < size; ++i)
+        {
+            pointDataVector.push_back(frozenNodes[i].point);
+            indexedPointData[frozenNodes[i].point] = i;
+        }
+
+        // Parents come before their children in the layout
+        if (size > 0)
+            nodeFloor[0] = 0;
+
+        for (SizeT i = 0; i < size; ++i)
+        {
+            const FrozenNode & node = frozenNodes[i];
+
+            if (node.lower != 0)
+            {
+                lowerIndex[i] = node.lower;
+                parentIndex[node.lower] = i;
+                nodeFloor[node.lower] = nodeFloor[i] + 1;
+            }
+
+            if (node.upper != 0)
+            {
+                upperIndex[i] = node.upper;
+                parentIndex[node.upper] = i;
+                nodeFloor[node.upper] = nodeFloor[i] + 1;
+            }
+
+            subtreeSizeByIndex[i] = node.subtreeSize;
+            if (TrackCoordinateSums)
+                coordinateSumByIndex[i] = frozenCoordinateSums[i];
+
+            if (node.lower != 0 || node.upper != 0)
+            {
+                Int lowerSize = node.lower != 0 ? Int(frozenNodes[node.lower].subtreeSize) : 0;
+                Int upperSize = node.upper != 0 ? Int(frozenNodes[node.upper].subtreeSize) : 0;
+
+                balanceByIndex[i] = upperSize - lowerSize;
+                indexByBalanceAndFloor[balanceByIndex[i]][nodeFloor[i]].insert(i);
+            }
+        }
+
+        // Children boundaries are needed first
+        for (SizeT i = size; i > 0; --i)
+        {
+            UpdateBoundaries(i - 1);
+        }
+
+        Release(frozenNodes);
+        Release(frozenCoordinateSums);
+        frozenErasedCount = 0;
+        frozen = false;
+    }
+
     bool RebalanceIteration()
     {
         bool didRebalance = false;
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace gbi
+{
+
+// Distance metric policies used by KDTree queries. A metric measures each axis on its own, either
+// between two coordinates or from a coordinate to the closest point of a range (the exact lower
+// bound over an AABB), and Combine folds the per-axis values into the distance. Ranges may be
+// unbounded on one side. Distances are only compared with each other, so they don't need to be true
+// distances (squared ones are fine).
+
+// Distance from a coordinate to a closed range, 0 inside it
+constexpr double DistanceToRange(double from, double lowest, double highest)
+{
+    return from < lowest ? lowest - from : (highest < from ? from - highest : 0.);
+}
+
+// Only negates in the branch, so that loops over it can be if-converted and vectorized
+constexpr double AbsoluteValue(double value)
+{
+    return value < 0. ? -value : value;
+}
+
+struct SquaredEuclideanMetric
+{
+    constexpr double AxisDistance(uint32_t, double from, double to) const
+    {
+        return (to - from) * (to - from);
+    }
+
+    constexpr double AxisDistanceToRange(uint32_t, double from, double lowest, double highest) const
+    {
+        return DistanceToRange(from, lowest, highest) * DistanceToRange(from, lowest, highest);
+    }
+
+    constexpr double Combine(double total, double axisDistance) const
+    {
+        return total + axisDistance;
+    }
+};
+
+// L1
+struct ManhattanMetric
+{
+    constexpr double AxisDistance(uint32_t, double from, double to) const
+    {
+        return AbsoluteValue(to - from);
+    }
+
+    constexpr double AxisDistanceToRange(uint32_t, double from, double lowest, double highest) const
+    {
+        return DistanceToRange(from, lowest, highest);
+    }
+
+    constexpr double Combine(double total, double axisDistance) const
+    {
+        return total + axisDistance;
+    }
+};
+
+// L infinity
+struct ChebyshevMetric
+{
+    constexpr double AxisDistance(uint32_t, double from, double to) const
+    {
+        return AbsoluteValue(to - from);
+    }
+
+    constexpr double AxisDistanceToRange(uint32_t, double from, double lowest, double highest) const
+    {
+        return DistanceToRange(from, lowest, highest);
+    }
+
+    constexpr double Combine(double total, double axisDistance) const
+    {
+        return total < axisDistance ? axisDistance : total;
+    }
+};
+
+// Squared L2 with a weight per axis
+template<uint32_t Dimension>
+struct WeightedSquaredEuclideanMetric
+{
+    std::array<double, Dimension> weights;
+
+    WeightedSquaredEuclideanMetric()
+    {
+        weights.fill(1.);
+    }
+
+    explicit WeightedSquaredEuclideanMetric(const std::array<double, Dimension> & weights) :
+        weights(weights)
+    {
+    }
+
+    double AxisDistance(uint32_t dim, double from, double to) const
+    {
+        return weights[dim] * (to - from) * (to - from);
+    }
+
+    double AxisDistanceToRange(uint32_t dim, double from, double lowest, double highest) const
+    {
+        double distance = DistanceToRange(from, lowest, highest);
+
+        return weights[dim] * distance * distance;
+    }
+
+    double Combine(double total, double axisDistance) const
+    {
+        return total + axisDistance;
+    }
+};
+
+// Squared L2 on a toroidal domain where axis dim wraps around every periods[dim].
+// Coordinates are expected to lie in [0, periods[dim]).
+template<uint32_t Dimension>
+struct PeriodicSquaredEuclideanMetric
+{
+    std::array<double, Dimension> periods;
+
+    explicit PeriodicSquaredEuclideanMetric(const std::array<double, Dimension> & periods) :
+        periods(periods)
+    {
+    }
+
+    double WrappedDistance(uint32_t dim, double from, double to) const
+    {
+        double distance = std::fmod(std::fabs(to - from), periods[dim]);
+
+        return std::fmin(distance, periods[dim] - distance);
+    }
+
+    double AxisDistance(uint32_t dim, double from, double to) const
+    {
+        double distance = WrappedDistance(dim, from, to);
+
+        return distance * distance;
+    }
+
+    // The range can be reached from either end, going around the domain. It is clipped to the
+    // domain first, which also bounds infinite ends.
+    double AxisDistanceToRange(uint32_t dim, double from, double lowest, double highest) const
+    {
+        lowest = std::fmax(lowest, 0.);
+        highest = std::fmin(highest, periods[dim]);
+
+        if (!(from < lowest) && !(highest < from))
+            return 0.;
+
+        double distance = std::fmin(WrappedDistance(dim, from, lowest), WrappedDistance(dim, from, highest));
+
+        return distance * distance;
+    }
+
+    double Combine(double total, double axisDistance) const
+    {
+        return total + axisDistance;
+    }
+};
+
+// Distance from query to a point, coordinates being anything indexable by dimension
+template<size_t Dimension, typename Metric, typename Coordinates>
+double PointDistance(const Metric & metric, const std::array<double, Dimension> & query, const Coordinates & coordinates)
+{
+    double distance = 0.;
+    for (size_t i = 0; i < Dimension; ++i)
+    {
+        distance = metric.Combine(distance, metric.AxisDistance(uint32_t(i), query[i], coordinates[i]));
+    }
+
+    return distance;
+}
+
+// Lower bound of the distance from query to any point of the AABB
+template<size_t Dimension, typename Metric, typename Coordinates>
+double BoxDistance(const Metric & metric, const std::array<double, Dimension> & query, const Coordinates & lowestCoordinates, const Coordinates & highestCoordinates)
+{
+    double distance = 0.;
+    for (size_t i = 0; i < Dimension; ++i)
+    {
+        distance = metric.Combine(distance, metric.AxisDistanceToRange(uint32_t(i), query[i], lowestCoordinates[i], highestCoordinates[i]));
+    }
+
+    return distance;
+}
+
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KDTree.h"
+
+namespace gbi
+{
+
+// Append oriented ingestion mode (Bentley-Saxe logarithmic method). Inserted points land in a small
+// unsorted buffer. When it is full, the buffer and the occupied levels below the first empty one are
+// rebuilt into that level as a single perfectly balanced frozen KDTree, level i holding up to
+// bufferCapacity * 2^i points. No rebalancing is ever needed.
+template<
+    typename PointWrapper,
+    UInt Dimension,
+    bool TrackCoordinateSums = false,
+    typename Metric = SquaredEuclideanMetric,
+    typename Allocator = std::allocator<PointData>>
+class LogarithmicKDTree
+{
+    typedef typename std::decay<decltype(std::declval<PointWrapper &>().Get(0))>::type Coordinate;
+    typedef KDTree<PointWrapper, Dimension, TrackCoordinateSums, Metric, Allocator> Level;
+
+    template<typename T>
+    using Vector = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+    // Buffer, coordinates are stored per dimension so that scanning them vectorizes: coordinate d of
+    // buffered point i is bufferCoordinates[d * bufferCapacity + i]
+    Vector<PointData> bufferPoints;
+    Vector<Coordinate> bufferCoordinates;
+    Vector<unsigned char> bufferScanMask;
+
+    Vector<Level> levels;
+
+    // Scratch buffers reused by FlushBuffer and Nearest
+    Vector<PointData> flushPoints;
+    Vector<double> bufferDistances;
+
+    // Data
+    SizeT bufferCapacity;
+    Metric metric;
+    Allocator allocator;
+
+public:
+
+    // Constructor
+    // A bufferCapacity of 0 is taken as 1.
+    explicit LogarithmicKDTree(SizeT bufferCapacity = 64, const Metric & metric = Metric(), const Allocator & allocator = Allocator()) :
+        bufferPoints(allocator),
+        bufferCoordinates(allocator),
+        bufferScanMask(allocator),
+        levels(allocator),
+        flushPoints(allocator),
+        bufferDistances(allocator),
+        bufferCapacity(std::max<SizeT>(bufferCapacity, 1)),
+        metric(metric),
+        allocator(allocator)
+    {
+        bufferPoints.reserve(this->bufferCapacity);
+        bufferCoordinates.resize(Dimension * this->bufferCapacity);
+        bufferScanMask.reserve(this->bufferCapacity);
+        bufferDistances.reserve(this->bufferCapacity);
+    }
+
+private:
+
+    // Methods
+    const Coordinate * BufferCoordinates(UInt dim) const
+    {
+        return bufferCoordinates.data() + dim * bufferCapacity;
+    }
+
+    void EraseFromBuffer(SizeT bufferIndex)
+    {
+        gbiAssert(bufferIndex < bufferPoints.size());
+
+        SizeT lastIndex = bufferPoints.size() - 1;
+
+        bufferPoints[bufferIndex] = bufferPoints[lastIndex];
+        bufferPoints.pop_back();
+
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            bufferCoordinates[d * bufferCapacity + bufferIndex] = bufferCoordinates[d * bufferCapacity + lastIndex];
+        }
+    }
+
+    void FlushBuffer()
+    {
+        flushPoints.assign(bufferPoints.begin(), bufferPoints.end());
+        bufferPoints.clear();
+
+        SizeT levelIndex = 0;
+        for (; levelIndex < levels.size() && levels[levelIndex].Size() > 0; ++levelIndex)
+        {
+            levels[levelIndex].ForEachPoint([this](PointData point)
+            {
+                flushPoints.push_back(point);
+            });
+
+            levels[levelIndex] = Level(metric, allocator);
+        }
+
+        if (levelIndex == levels.size())
+            levels.push_back(Level(metric, allocator));
+
+        levels[levelIndex].Build(flushPoints.begin(), flushPoints.end());
+
+        flushPoints.clear();
+    }
+
+    // Flags buffered points inside [lowerCorner, upperCorner] in bufferScanMask, one dimension at a
+    // time over contiguous coordinates
+    void ScanBuffer(PointData lowerCorner, PointData upperCorner)
+    {
+        SizeT bufferSize = bufferPoints.size();
+
+        bufferScanMask.assign(bufferSize, 1);
+        unsigned char * mask = bufferScanMask.data();
+
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            const Coordinate * coordinates = BufferCoordinates(d);
+            Coordinate lowerCoordinate = PointWrapper(lowerCorner).Get(d);
+            Coordinate upperCoordinate = PointWrapper(upperCorner).Get(d);
+
+            for (SizeT i = 0; i < bufferSize; ++i)
+            {
+                mask[i] &= (unsigned char)(!(coordinates[i] < lowerCoordinate) & !(upperCoordinate < coordinates[i]));
+            }
+        }
+    }
+
+public:
+
+    SizeT Size() const
+    {
+        SizeT size = bufferPoints.size();
+
+        for (auto & level : levels)
+        {
+            size += level.Size();
+        }
+
+        return size;
+    }
+
+    SizeT LevelCount() const
+    {
+        return levels.size();
+    }
+
+    // Pre-sizes the level table and the FlushBuffer scratch buffer for size points. Levels are
+    // rebuilt to fit on every flush, so their own storage is allocated then.
+    void Reserve(SizeT size)
+    {
+        SizeT levelCount = 0;
+        SizeT levelsCapacity = 0;
+
+        while (levelsCapacity < size)
+        {
+            levelsCapacity += bufferCapacity << levelCount;
+            ++levelCount;
+        }
+
+        levels.reserve(levelCount);
+        flushPoints.reserve(size);
+    }
+
+    void Insert(PointData point)
+    {
+        if (point != nullptr)
+        {
+            for (UInt d = 0; d < Dimension; ++d)
+            {
+                bufferCoordinates[d * bufferCapacity + bufferPoints.size()] = PointWrapper(point).Get(d);
+            }
+            bufferPoints.push_back(point);
+
+            if (bufferPoints.size() >= bufferCapacity)
+                FlushBuffer();
+        }
+    }
+
+    // Erasing from a level leaves it frozen, the point is only marked as erased there until the level
+    // is rebuilt
+    void Erase(PointData point)
+    {
+        auto it = std::find(bufferPoints.begin(), bufferPoints.end(), point);
+
+        if (it != bufferPoints.end())
+        {
+            EraseFromBuffer(it - bufferPoints.begin());
+        }
+        else
+        {
+            for (auto & level : levels)
+            {
+                if (level.Contains(point))
+                {
+                    level.Erase(point);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Calls visitor(PointData) once for every point
+    template<typename Visitor>
+    void ForEachPoint(Visitor visitor) const
+    {
+        for (auto point : bufferPoints)
+        {
+            visitor(point);
+        }
+
+        for (auto & level : levels)
+        {
+            level.ForEachPoint(visitor);
+        }
+    }
+
+    // Closest point to query according to Metric, nullptr if there is none
+    PointData Nearest(PointData query)
+    {
+        std::array<double, Dimension> queryCoordinates;
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            queryCoordinates[d] = PointWrapper(query).Get(d);
+        }
+
+        PointData nearest = nullptr;
+        double nearestDistance = std::numeric_limits<double>::infinity();
+
+        // Distances to the buffered points are accumulated one dimension at a time over contiguous
+        // coordinates, as ScanBuffer does
+        SizeT bufferSize = bufferPoints.size();
+
+        bufferDistances.assign(bufferSize, 0.);
+        double * distances = bufferDistances.data();
+
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            const Coordinate * coordinates = BufferCoordinates(d);
+            double queryCoordinate = queryCoordinates[d];
+
+            for (SizeT i = 0; i < bufferSize; ++i)
+            {
+                distances[i] = metric.Combine(distances[i], metric.AxisDistance(d, queryCoordinate, coordinates[i]));
+            }
+        }
+
+        for (SizeT i = 0; i < bufferSize; ++i)
+        {
+            if (distances[i] < nearestDistance)
+            {
+                nearest = bufferPoints[i];
+                nearestDistance = distances[i];
+            }
+        }
+
+        // Levels only look for points closer than the best one found so far
+        for (auto & level : levels)
+        {
+            double levelDistance;
+            PointData levelNearest = level.Nearest(query, nearestDistance, levelDistance);
+
+            if (levelNearest != nullptr)
+            {
+                nearest = levelNearest;
+                nearestDistance = levelDistance;
+            }
+        }
+
+        return nearest;
+    }
+
+    // Counts points inside the closed box [lowerCorner, upperCorner]
+    SizeT RangeCount(PointData lowerCorner, PointData upperCorner)
+    {
+        ScanBuffer(lowerCorner, upperCorner);
+
+        SizeT count = 0;
+        for (auto inRange : bufferScanMask)
+        {
+            count += inRange;
+        }
+
+        for (auto & level : levels)
+        {
+            count += level.RangeCount(lowerCorner, upperCorner);
+        }
+
+        return count;
+    }
+
+    // Same as RangeCount, also accumulating the coordinates of the points found into coordinateSum
+    SizeT RangeAggregate(PointData lowerCorner, PointData upperCorner, std::array<double, Dimension> & coordinateSum)
+    {
+        static_assert(TrackCoordinateSums, "RangeAggregate requires TrackCoordinateSums");
+
+        ScanBuffer(lowerCorner, upperCorner);
+
+        SizeT count = 0;
+        for (auto inRange : bufferScanMask)
+        {
+            count += inRange;
+        }
+
+        for (UInt d = 0; d < Dimension; ++d)
+        {
+            const Coordinate * coordinates = BufferCoordinates(d);
+
+            double sum = 0.;
+            for (SizeT i = 0; i < bufferScanMask.size(); ++i)
+            {
+                sum += bufferScanMask[i] ? double(coordinates[i]) : 0.;
+            }
+
+            coordinateSum[d] = sum;
+        }
+
+        for (auto & level : levels)
+        {
+            std::array<double, Dimension> levelCoordinateSum;
+            count += level.RangeAggregate(lowerCorner, upperCorner, levelCoordinateSum);
+
+            for (UInt d = 0; d < Dimension; ++d)
+            {
+                coordinateSum[d] += levelCoordinateSum[d];
+            }
+        }
+
+        return count;
+    }
+};
+
+}
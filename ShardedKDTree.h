@@ -0,0 +1,492 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KDTree.h"
+
+namespace gbi
+{
+
+// Front end spreading points over independent KDTree shards, each one owning a slab of space along
+// a single dimension and guarded by its own mutex, so that writers on different slabs don't contend.
+template<
+    typename PointWrapper,
+    UInt Dimension,
+    bool TrackCoordinateSums = false,
+    typename Metric = SquaredEuclideanMetric,
+    typename Allocator = std::allocator<PointData>>
+class ShardedKDTree
+{
+    typedef typename std::decay<decltype(std::declval<PointWrapper &>().Get(0))>::type Coordinate;
+
+    template<typename T>
+    using Vector = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+    // Shard i holds points with splits[i - 1] <= coordinate < splits[i] along splitDimension.
+    // Its own copy of the bounds is only read or written under its mutex.
+    struct Shard
+    {
+        Shard(const Metric & metric, const Allocator & allocator) :
+            tree(metric, allocator)
+        {
+        }
+
+        KDTree<PointWrapper, Dimension, TrackCoordinateSums, Metric, Allocator> tree;
+        std::mutex mutex;
+        Coordinate lowerSplit;
+        Coordinate upperSplit;
+    };
+
+    Vector<std::unique_ptr<Shard>> shards;
+
+    // Routing table, only a hint: a shard checks its own bounds once locked. Entries are atomic so
+    // that routing never takes a lock, even while MoveSplit updates them.
+    Vector<std::atomic<Coordinate>> splits;
+
+    // Data
+    UInt splitDimension;
+    Metric metric;
+
+public:
+
+    // Constructor
+    // Splits are the quantiles of the sample along the dimension where it spreads the most. A
+    // shardCount of 0 is taken as 1.
+    ShardedKDTree(UInt shardCount, const std::vector<PointData> & sample, const Metric & metric = Metric(), const Allocator & allocator = Allocator()) :
+        shards(allocator),
+        splits(std::max<UInt>(shardCount, 1) - 1, allocator),
+        splitDimension(0),
+        metric(metric)
+    {
+        shardCount = std::max<UInt>(shardCount, 1);
+
+        if (!sample.empty())
+        {
+            Coordinate widestSpread = Coordinate();
+
+            for (UInt i = 0; i < Dimension; ++i)
+            {
+                auto bounds = std::minmax_element(sample.begin(), sample.end(), [i](PointData p1, PointData p2)
+                {
+                    return PointWrapper(p1).Get(i) < PointWrapper(p2).Get(i);
+                });
+
+                Coordinate spread = PointWrapper(*bounds.second).Get(i) - PointWrapper(*bounds.first).Get(i);
+                if (i == 0 || widestSpread < spread)
+                {
+                    widestSpread = spread;
+                    splitDimension = i;
+                }
+            }
+        }
+
+        Vector<Coordinate> sampleCoordinates(allocator);
+        sampleCoordinates.reserve(sample.size());
+        for (auto point : sample)
+        {
+            sampleCoordinates.push_back(PointWrapper(point).Get(splitDimension));
+        }
+        std::sort(sampleCoordinates.begin(), sampleCoordinates.end());
+
+        for (UInt i = 1; i < shardCount; ++i)
+        {
+            splits[i - 1].store(sampleCoordinates.empty() ? Coordinate() : sampleCoordinates[sampleCoordinates.size() * i / shardCount]);
+        }
+
+        for (UInt i = 0; i < shardCount; ++i)
+        {
+            shards.emplace_back(new Shard(metric, allocator));
+            shards[i]->lowerSplit = i > 0 ? splits[i - 1].load() : Coordinate();
+            shards[i]->upperSplit = i + 1 < shardCount ? splits[i].load() : Coordinate();
+        }
+    }
+
+private:
+
+    // Methods
+    // Upper bound of coordinate in splits. A concurrent MoveSplit can make it read a mix of old and
+    // new entries, which at worst routes to a neighbour shard whose bounds check then fails.
+    SizeT RouteCoordinate(Coordinate coordinate) const
+    {
+        SizeT first = 0;
+        SizeT count = splits.size();
+
+        while (count > 0)
+        {
+            SizeT step = count / 2;
+
+            if (!(coordinate < splits[first + step].load(std::memory_order_acquire)))
+            {
+                first += step + 1;
+                count -= step + 1;
+            }
+            else
+            {
+                count = step;
+            }
+        }
+
+        return first;
+    }
+
+    bool IsAboveLowerSplit(SizeT shardIndex, Coordinate coordinate) const
+    {
+        return shardIndex == 0 || !(coordinate < shards[shardIndex]->lowerSplit);
+    }
+
+    bool IsBelowUpperSplit(SizeT shardIndex, Coordinate coordinate) const
+    {
+        return shardIndex + 1 == shards.size() || coordinate < shards[shardIndex]->upperSplit;
+    }
+
+    // Locks the shard owning the coordinate, retrying if its split moved in the meantime
+    SizeT LockShard(Coordinate coordinate, std::unique_lock<std::mutex> & lock)
+    {
+        while (true)
+        {
+            SizeT shardIndex = RouteCoordinate(coordinate);
+
+            lock = std::unique_lock<std::mutex>(shards[shardIndex]->mutex);
+            if (IsAboveLowerSplit(shardIndex, coordinate) && IsBelowUpperSplit(shardIndex, coordinate))
+                return shardIndex;
+
+            lock.unlock();
+        }
+    }
+
+    // Holds the locks of the contiguous run of shards covering [lowerCoordinate, upperCoordinate], all
+    // taken at once so that no point can move between them while they are queried. Shards are always
+    // locked in ascending order.
+    class ShardRangeLock
+    {
+        ShardedKDTree & owner;
+
+    public:
+
+        SizeT firstShard;
+        SizeT lastShard;
+
+        ShardRangeLock(ShardedKDTree & owner, Coordinate lowerCoordinate, Coordinate upperCoordinate) :
+            owner(owner)
+        {
+            while (true)
+            {
+                firstShard = owner.RouteCoordinate(lowerCoordinate);
+                lastShard = std::max(firstShard, owner.RouteCoordinate(upperCoordinate));
+
+                for (SizeT i = firstShard; i <= lastShard; ++i)
+                {
+                    owner.shards[i]->mutex.lock();
+                }
+
+                if (owner.IsAboveLowerSplit(firstShard, lowerCoordinate) && owner.IsBelowUpperSplit(lastShard, upperCoordinate))
+                    return;
+
+                Unlock();
+            }
+        }
+
+        ~ShardRangeLock()
+        {
+            Unlock();
+        }
+
+        ShardRangeLock(const ShardRangeLock &) = delete;
+        ShardRangeLock & operator=(const ShardRangeLock &) = delete;
+
+    private:
+
+        void Unlock()
+        {
+            for (SizeT i = firstShard; i <= lastShard; ++i)
+            {
+                owner.shards[i]->mutex.unlock();
+            }
+        }
+    };
+
+    // Moves the split between shardIndex and shardIndex + 1 so that both end up with about the same
+    // number of points. Both shards must be locked.
+    bool MoveSplit(SizeT shardIndex)
+    {
+        Shard & lowerShard = *shards[shardIndex];
+        Shard & upperShard = *shards[shardIndex + 1];
+        bool fromLower = lowerShard.tree.Size() > upperShard.tree.Size();
+        Shard & source = fromLower ? lowerShard : upperShard;
+        Shard & destination = fromLower ? upperShard : lowerShard;
+
+        Vector<Coordinate> coordinates(shards.get_allocator());
+        coordinates.reserve(source.tree.Size());
+        source.tree.ForEachPoint([this, &coordinates](PointData point)
+        {
+            coordinates.push_back(PointWrapper(point).Get(splitDimension));
+        });
+
+        SizeT moveCount = (lowerShard.tree.Size() > upperShard.tree.Size() ?
+            lowerShard.tree.Size() - upperShard.tree.Size() :
+            upperShard.tree.Size() - lowerShard.tree.Size()) / 2;
+
+        if (moveCount == 0)
+            return false;
+
+        // Points from the lower shard at or above the new split move up, points from the upper shard
+        // below it move down
+        SizeT splitRank = fromLower ? coordinates.size() - moveCount : moveCount;
+        std::nth_element(coordinates.begin(), coordinates.begin() + splitRank, coordinates.end());
+        Coordinate newSplit = coordinates[splitRank];
+
+        // Every point would leave the lower shard (or none the upper one): nothing sensible to do
+        if (!(*std::min_element(coordinates.begin(), coordinates.end()) < newSplit))
+            return false;
+
+        splits[shardIndex].store(newSplit, std::memory_order_release);
+        lowerShard.upperSplit = newSplit;
+        upperShard.lowerSplit = newSplit;
+
+        Vector<PointData> movedPoints(shards.get_allocator());
+        source.tree.ForEachPoint([this, &movedPoints, fromLower, newSplit](PointData point)
+        {
+            if (fromLower != (PointWrapper(point).Get(splitDimension) < newSplit))
+                movedPoints.push_back(point);
+        });
+
+        for (auto point : movedPoints)
+        {
+            source.tree.Erase(point);
+            destination.tree.Insert(point);
+        }
+
+        return !movedPoints.empty();
+    }
+
+public:
+
+    SizeT ShardCount() const
+    {
+        return shards.size();
+    }
+
+    UInt SplitDimension() const
+    {
+        return splitDimension;
+    }
+
+    SizeT Size()
+    {
+        SizeT size = 0;
+
+        for (auto & shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            size += shard->tree.Size();
+        }
+
+        return size;
+    }
+
+    // Safe to call from several threads at once
+    void Insert(PointData point)
+    {
+        if (point != nullptr)
+        {
+            std::unique_lock<std::mutex> lock;
+            SizeT shardIndex = LockShard(PointWrapper(point).Get(splitDimension), lock);
+
+            shards[shardIndex]->tree.Insert(point);
+        }
+    }
+
+    // Safe to call from several threads at once
+    void Erase(PointData point)
+    {
+        if (point != nullptr)
+        {
+            std::unique_lock<std::mutex> lock;
+            SizeT shardIndex = LockShard(PointWrapper(point).Get(splitDimension), lock);
+
+            shards[shardIndex]->tree.Erase(point);
+        }
+    }
+
+    // Pre-sizes every shard for an even share of size points
+    void Reserve(SizeT size)
+    {
+        SizeT shardSize = (size + shards.size() - 1) / shards.size();
+
+        for (auto & shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->tree.Reserve(shardSize);
+        }
+    }
+
+    // Counts points inside the closed box [lowerCorner, upperCorner] over all shards it overlaps
+    SizeT RangeCount(PointData lowerCorner, PointData upperCorner)
+    {
+        ShardRangeLock lock(*this, PointWrapper(lowerCorner).Get(splitDimension), PointWrapper(upperCorner).Get(splitDimension));
+
+        SizeT count = 0;
+        for (SizeT i = lock.firstShard; i <= lock.lastShard; ++i)
+        {
+            count += shards[i]->tree.RangeCount(lowerCorner, upperCorner);
+        }
+
+        return count;
+    }
+
+    // Same as RangeCount, also accumulating the coordinates of the points found into coordinateSum
+    SizeT RangeAggregate(PointData lowerCorner, PointData upperCorner, std::array<double, Dimension> & coordinateSum)
+    {
+        static_assert(TrackCoordinateSums, "RangeAggregate requires TrackCoordinateSums");
+
+        ShardRangeLock lock(*this, PointWrapper(lowerCorner).Get(splitDimension), PointWrapper(upperCorner).Get(splitDimension));
+
+        SizeT count = 0;
+        coordinateSum.fill(0.);
+        for (SizeT i = lock.firstShard; i <= lock.lastShard; ++i)
+        {
+            std::array<double, Dimension> shardCoordinateSum;
+            count += shards[i]->tree.RangeAggregate(lowerCorner, upperCorner, shardCoordinateSum);
+
+            for (UInt d = 0; d < Dimension; ++d)
+            {
+                coordinateSum[d] += shardCoordinateSum[d];
+            }
+        }
+
+        return count;
+    }
+
+    // Closest point to query over all shards according to Metric, nullptr if there is none. The shard
+    // owning the query is searched first, then the others one at a time, taking the side whose slabs
+    // are the closer, until the slabs left on both sides are farther than the best point found. Slab
+    // bounds are read from the routing table without locking, so a point moved by a concurrent
+    // RebalanceShards can be missed.
+    PointData Nearest(PointData query)
+    {
+        std::array<double, Dimension> queryCoordinates;
+        for (UInt i = 0; i < Dimension; ++i)
+        {
+            queryCoordinates[i] = PointWrapper(query).Get(i);
+        }
+
+        PointData nearest = nullptr;
+        double nearestDistance = std::numeric_limits<double>::infinity();
+
+        auto searchShard = [&](SizeT shardIndex)
+        {
+            double shardDistance;
+            PointData shardNearest = shards[shardIndex]->tree.Nearest(query, nearestDistance, shardDistance);
+
+            if (shardNearest != nullptr)
+            {
+                nearest = shardNearest;
+                nearestDistance = shardDistance;
+            }
+        };
+
+        double infinity = std::numeric_limits<double>::infinity();
+
+        auto sideDistance = [&](double lowest, double highest)
+        {
+            return metric.Combine(0., metric.AxisDistanceToRange(splitDimension, queryCoordinates[splitDimension], lowest, highest));
+        };
+
+        SizeT queryShard;
+        {
+            std::unique_lock<std::mutex> lock;
+            queryShard = LockShard(Coordinate(queryCoordinates[splitDimension]), lock);
+
+            searchShard(queryShard);
+        }
+
+        // Shards lowerShard to upperShard have been searched. The ones left below all lie under
+        // splits[lowerShard - 1] and the ones left above over splits[upperShard], so the distances to
+        // these half-lines bound the distance to any point left on each side.
+        SizeT lowerShard = queryShard;
+        SizeT upperShard = queryShard;
+
+        while (true)
+        {
+            double lowerSideDistance = lowerShard > 0 ?
+                sideDistance(-infinity, splits[lowerShard - 1].load(std::memory_order_acquire)) :
+                infinity;
+            double upperSideDistance = upperShard + 1 < shards.size() ?
+                sideDistance(splits[upperShard].load(std::memory_order_acquire), infinity) :
+                infinity;
+
+            if (!(std::min(lowerSideDistance, upperSideDistance) < nearestDistance))
+                break;
+
+            SizeT shardIndex = lowerSideDistance <= upperSideDistance ? --lowerShard : ++upperShard;
+
+            std::lock_guard<std::mutex> lock(shards[shardIndex]->mutex);
+            searchShard(shardIndex);
+        }
+
+        return nearest;
+    }
+
+    // Runs one RebalanceIteration on every shard, returns true if any of them did something
+    bool RebalanceIteration()
+    {
+        bool didRebalance = false;
+
+        for (auto & shard : shards)
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            didRebalance = shard->tree.RebalanceIteration() || didRebalance;
+        }
+
+        return didRebalance;
+    }
+
+    // Moves the split between the most unevenly loaded pair of neighbour shards, as long as one of
+    // them holds more than twice the points of the other. Returns true if points were moved.
+    bool RebalanceShards()
+    {
+        bool skewFound = false;
+        SizeT mostSkewedShard = 0;
+        SizeT largestDifference = 0;
+        SizeT previousSize = 0;
+
+        for (SizeT i = 0; i < shards.size(); ++i)
+        {
+            SizeT size;
+            {
+                std::lock_guard<std::mutex> lock(shards[i]->mutex);
+                size = shards[i]->tree.Size();
+            }
+
+            SizeT smaller = std::min(previousSize, size);
+            SizeT larger = std::max(previousSize, size);
+
+            if (i > 0 && larger > 2 * smaller + 1 && larger - smaller > largestDifference)
+            {
+                skewFound = true;
+                mostSkewedShard = i - 1;
+                largestDifference = larger - smaller;
+            }
+
+            previousSize = size;
+        }
+
+        if (!skewFound)
+            return false;
+
+        std::lock_guard<std::mutex> lowerLock(shards[mostSkewedShard]->mutex);
+        std::lock_guard<std::mutex> upperLock(shards[mostSkewedShard + 1]->mutex);
+
+        return MoveSplit(mostSkewedShard);
+    }
+};
+
+}
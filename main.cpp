@@ -1,7 +1,18 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
 
 #include "KDTree.h"
+#include "LogarithmicKDTree.h"
+#include "ShardedKDTree.h"
 
 
 struct Point
@@ -40,6 +51,847 @@ public:
     }
 };
 
+// Hands out blocks by size rounded up to a power of two, carving them from chunks taken from
+// operator new, and keeps freed blocks for reuse. Once the pool has seen the peak use of every size,
+// allocating no longer goes upstream.
+class BlockPool
+{
+    static const size_t blocksPerChunk = 16;
+
+    std::map<size_t, void *> freeBlocks;
+    std::vector<void *> chunks;
+    size_t arrayAllocationCount;
+
+    static size_t SizeClass(size_t size)
+    {
+        size_t sizeClass = sizeof(void *);
+        while (sizeClass < size)
+        {
+            sizeClass *= 2;
+        }
+
+        return sizeClass;
+    }
+
+public:
+
+    BlockPool() :
+        arrayAllocationCount(0)
+    {
+    }
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool & operator=(const BlockPool &) = delete;
+
+    ~BlockPool()
+    {
+        for (auto chunk : chunks)
+        {
+            ::operator delete(chunk);
+        }
+    }
+
+    // elementCount is the number of elements the caller asked for
+    void * Allocate(size_t size, size_t elementCount)
+    {
+        if (elementCount > 1)
+            ++arrayAllocationCount;
+
+        size_t sizeClass = SizeClass(size);
+        void *& freeBlock = freeBlocks[sizeClass];
+
+        if (freeBlock == nullptr)
+        {
+            char * chunk = static_cast<char *>(::operator new(sizeClass * blocksPerChunk));
+            chunks.push_back(chunk);
+
+            for (size_t i = 0; i < blocksPerChunk; ++i)
+            {
+                Deallocate(chunk + i * sizeClass, sizeClass);
+            }
+        }
+
+        void * block = freeBlock;
+        freeBlock = *static_cast<void **>(block);
+
+        return block;
+    }
+
+    void Deallocate(void * block, size_t size)
+    {
+        void *& freeBlock = freeBlocks[SizeClass(size)];
+
+        *static_cast<void **>(block) = freeBlock;
+        freeBlock = block;
+    }
+
+    // Number of chunks taken from operator new so far
+    size_t UpstreamAllocationCount() const
+    {
+        return chunks.size();
+    }
+
+    // Number of allocations of more than one element so far. Node based containers allocate their
+    // nodes one at a time, so this counts vectors and hash bucket arrays growing, whether the pool
+    // recycles their blocks or not. A vector growing to a single element is not counted.
+    size_t ArrayAllocationCount() const
+    {
+        return arrayAllocationCount;
+    }
+};
+
+// Not default constructible, so that a container built without the allocator given to a tree
+// doesn't compile
+template<typename T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    BlockPool * pool;
+
+    explicit PoolAllocator(BlockPool & pool) :
+        pool(&pool)
+    {
+    }
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> & other) :
+        pool(other.pool)
+    {
+    }
+
+    T * allocate(size_t count)
+    {
+        return static_cast<T *>(pool->Allocate(count * sizeof(T), count));
+    }
+
+    void deallocate(T * block, size_t count)
+    {
+        pool->Deallocate(block, count * sizeof(T));
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const PoolAllocator<T> & allocator1, const PoolAllocator<U> & allocator2)
+{
+    return allocator1.pool == allocator2.pool;
+}
+
+template<typename T, typename U>
+bool operator!=(const PoolAllocator<T> & allocator1, const PoolAllocator<U> & allocator2)
+{
+    return allocator1.pool != allocator2.pool;
+}
+
+std::vector<Point> RandomPoints(std::mt19937 & generator, size_t count)
+{
+    std::uniform_real_distribution<float> coordinate(0.f, 1000.f);
+
+    std::vector<Point> pointVector(count);
+    for (auto & point : pointVector)
+    {
+        point.x = coordinate(generator);
+        point.y = coordinate(generator);
+        point.z = coordinate(generator);
+    }
+
+    return pointVector;
+}
+
+bool IsInBox(const Point & point, const Point & lowerCorner, const Point & upperCorner)
+{
+    return !(point.x < lowerCorner.x) && !(upperCorner.x < point.x) &&
+        !(point.y < lowerCorner.y) && !(upperCorner.y < point.y) &&
+        !(point.z < lowerCorner.z) && !(upperCorner.z < point.z);
+}
+
+// Random boxes, from empty ones to boxes covering most of the points
+void RandomBox(std::mt19937 & generator, Point & lowerCorner, Point & upperCorner)
+{
+    std::uniform_real_distribution<float> coordinate(-50.f, 1050.f);
+
+    Point corners[2] = {};
+    for (auto & corner : corners)
+    {
+        corner.x = coordinate(generator);
+        corner.y = coordinate(generator);
+        corner.z = coordinate(generator);
+    }
+
+    lowerCorner.x = std::min(corners[0].x, corners[1].x);
+    lowerCorner.y = std::min(corners[0].y, corners[1].y);
+    lowerCorner.z = std::min(corners[0].z, corners[1].z);
+    upperCorner.x = std::max(corners[0].x, corners[1].x);
+    upperCorner.y = std::max(corners[0].y, corners[1].y);
+    upperCorner.z = std::max(corners[0].z, corners[1].z);
+}
+
+// Erases a random point from both the tree and pointers, and returns it
+template<typename Tree>
+Point * EraseRandomPoint(Tree & tree, std::vector<Point *> & pointers, std::mt19937 & generator)
+{
+    size_t index = std::uniform_int_distribution<size_t>(0, pointers.size() - 1)(generator);
+    Point * point = pointers[index];
+
+    tree.Erase(point);
+
+    pointers[index] = pointers.back();
+    pointers.pop_back();
+
+    return point;
+}
+
+// RangeCount against a linear scan of the points the tree should hold
+template<typename Tree>
+bool CheckRangeCount(Tree & tree, const std::vector<Point *> & pointers, std::mt19937 & generator)
+{
+    for (int query = 0; query < 20; ++query)
+    {
+        Point lowerCorner, upperCorner;
+        RandomBox(generator, lowerCorner, upperCorner);
+
+        size_t expected = 0;
+        for (auto point : pointers)
+        {
+            expected += IsInBox(*point, lowerCorner, upperCorner) ? 1 : 0;
+        }
+
+        if (tree.RangeCount(&lowerCorner, &upperCorner) != expected)
+            return false;
+    }
+
+    return true;
+}
+
+// RangeAggregate against a linear scan, sums are compared up to rounding
+template<typename Tree>
+bool CheckRangeAggregate(Tree & tree, const std::vector<Point *> & pointers, std::mt19937 & generator)
+{
+    for (int query = 0; query < 20; ++query)
+    {
+        Point lowerCorner, upperCorner;
+        RandomBox(generator, lowerCorner, upperCorner);
+
+        size_t expectedCount = 0;
+        double expectedSum[3] = {};
+        for (auto point : pointers)
+        {
+            if (IsInBox(*point, lowerCorner, upperCorner))
+            {
+                ++expectedCount;
+                expectedSum[0] += point->x;
+                expectedSum[1] += point->y;
+                expectedSum[2] += point->z;
+            }
+        }
+
+        std::array<double, 3> coordinateSum;
+        if (tree.RangeAggregate(&lowerCorner, &upperCorner, coordinateSum) != expectedCount)
+            return false;
+
+        for (int d = 0; d < 3; ++d)
+        {
+            if (std::fabs(coordinateSum[d] - expectedSum[d]) > 1e-9 * 1000. * (expectedCount + 1))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// The tree should hold pointers, and none of erased
+template<typename Tree>
+bool CheckContains(Tree & tree, const std::vector<Point *> & pointers, const std::vector<Point *> & erased)
+{
+    for (auto point : pointers)
+    {
+        if (!tree.Contains(point))
+            return false;
+    }
+
+    for (auto point : erased)
+    {
+        if (tree.Contains(point))
+            return false;
+    }
+
+    return tree.Size() == pointers.size();
+}
+
+std::array<double, 3> Coordinates(const Point & point)
+{
+    std::array<double, 3> coordinates = {{ point.x, point.y, point.z }};
+
+    return coordinates;
+}
+
+// Nearest should find a point at the smallest distance from the query, ties being broken arbitrarily
+template<typename Tree, typename Metric>
+bool CheckNearest(Tree & tree, const Metric & metric, const std::vector<Point *> & pointers, std::vector<Point> & queries)
+{
+    for (auto & query : queries)
+    {
+        double expectedDistance = std::numeric_limits<double>::infinity();
+        for (auto point : pointers)
+        {
+            expectedDistance = std::min(expectedDistance, gbi::PointDistance(metric, Coordinates(query), Coordinates(*point)));
+        }
+
+        gbi::PointData nearest = tree.Nearest(&query);
+        if (nearest == nullptr ||
+            gbi::PointDistance(metric, Coordinates(query), Coordinates(*static_cast<Point *>(nearest))) != expectedDistance)
+            return false;
+    }
+
+    return true;
+}
+
+// Random inserts then erases, rebalancing after each of them, which relocates nodes all the time
+bool CheckRandomErase()
+{
+    std::mt19937 generator(26);
+    std::vector<Point> pointVector = RandomPoints(generator, 5000);
+
+    gbi::KDTree<PointWrapper, 3> kdTree;
+
+    for (auto & point : pointVector)
+    {
+        kdTree.Insert(&point);
+        while (kdTree.RebalanceIteration());
+    }
+
+    std::vector<Point *> eraseOrder;
+    for (auto & point : pointVector)
+    {
+        eraseOrder.push_back(&point);
+    }
+
+    std::shuffle(eraseOrder.begin(), eraseOrder.end(), generator);
+
+    for (auto point : eraseOrder)
+    {
+        kdTree.Erase(point);
+        while (kdTree.RebalanceIteration());
+    }
+
+    // Nothing left to rebalance once every point is gone
+    return !kdTree.RebalanceIteration();
+}
+
+// Mixed inserts and erases, queried along the way
+bool CheckRangeQueries()
+{
+    std::mt19937 generator(126);
+    std::vector<Point> pointVector = RandomPoints(generator, 4000);
+
+    gbi::KDTree<PointWrapper, 3, true> kdTree;
+    std::vector<Point *> pointers;
+
+    for (size_t i = 0; i < pointVector.size(); ++i)
+    {
+        kdTree.Insert(&pointVector[i]);
+        pointers.push_back(&pointVector[i]);
+
+        if (i % 3 == 2)
+            EraseRandomPoint(kdTree, pointers, generator);
+
+        while (kdTree.RebalanceIteration());
+
+        if (i % 400 == 399)
+        {
+            if (kdTree.Size() != pointers.size() ||
+                !CheckRangeCount(kdTree, pointers, generator) ||
+                !CheckRangeAggregate(kdTree, pointers, generator))
+                return false;
+        }
+    }
+
+    while (!pointers.empty())
+    {
+        EraseRandomPoint(kdTree, pointers, generator);
+
+        if (pointers.size() % 400 == 0 && !CheckRangeAggregate(kdTree, pointers, generator))
+            return false;
+    }
+
+    return kdTree.Size() == 0;
+}
+
+// Queries on the frozen layout, built by Freeze or by Build, with updates thawing it in between
+bool CheckFreezeThaw()
+{
+    std::mt19937 generator(127);
+    std::vector<Point> pointVector = RandomPoints(generator, 3000);
+
+    gbi::KDTree<PointWrapper, 3, true> kdTree;
+    std::vector<Point *> pointers;
+    std::vector<Point *> erased;
+    size_t inserted = 0;
+
+    auto update = [&]()
+    {
+        kdTree.Insert(&pointVector[inserted]);
+        pointers.push_back(&pointVector[inserted]);
+        ++inserted;
+
+        if (inserted % 2 == 0)
+            erased.push_back(EraseRandomPoint(kdTree, pointers, generator));
+
+        while (kdTree.RebalanceIteration());
+    };
+
+    auto check = [&]()
+    {
+        return CheckContains(kdTree, pointers, erased) &&
+            CheckRangeCount(kdTree, pointers, generator) &&
+            CheckRangeAggregate(kdTree, pointers, generator);
+    };
+
+    while (inserted < 1000)
+    {
+        update();
+    }
+
+    for (int round = 0; round < 4; ++round)
+    {
+        kdTree.Freeze();
+        if (!kdTree.IsFrozen() || !check())
+            return false;
+
+        for (int i = 0; i < 300; ++i)
+        {
+            update();
+        }
+
+        if (kdTree.IsFrozen() || !check())
+            return false;
+    }
+
+    kdTree.Build(pointers.begin(), pointers.end());
+    if (!kdTree.IsFrozen() || !check())
+        return false;
+
+    while (inserted < pointVector.size())
+    {
+        update();
+    }
+
+    return !kdTree.IsFrozen() && check();
+}
+
+// Nearest on every kind of tree, with points erased beforehand so that the frozen layouts hold
+// erased nodes
+template<typename Metric>
+bool CheckNearest(const Metric & metric)
+{
+    std::mt19937 generator(133);
+    std::vector<Point> pointVector = RandomPoints(generator, 1500);
+    std::vector<Point> queries = RandomPoints(generator, 100);
+
+    // Queries on points of the trees too
+    for (size_t i = 0; i < 20; ++i)
+    {
+        queries.push_back(pointVector[i * 50]);
+    }
+
+    std::vector<Point *> pointers;
+    for (auto & point : pointVector)
+    {
+        pointers.push_back(&point);
+    }
+
+    gbi::KDTree<PointWrapper, 3, false, Metric> kdTree(metric);
+    gbi::LogarithmicKDTree<PointWrapper, 3, false, Metric> logarithmicTree(32, metric);
+    gbi::ShardedKDTree<PointWrapper, 3, false, Metric> shardedTree(6, std::vector<gbi::PointData>(pointers.begin(), pointers.end()), metric);
+
+    for (auto point : pointers)
+    {
+        kdTree.Insert(point);
+        logarithmicTree.Insert(point);
+        shardedTree.Insert(point);
+
+        while (kdTree.RebalanceIteration());
+    }
+
+    while (shardedTree.RebalanceIteration());
+
+    for (int i = 0; i < 500; ++i)
+    {
+        Point * point = EraseRandomPoint(kdTree, pointers, generator);
+
+        logarithmicTree.Erase(point);
+        shardedTree.Erase(point);
+
+        while (kdTree.RebalanceIteration());
+    }
+
+    if (!CheckNearest(kdTree, metric, pointers, queries) ||
+        !CheckNearest(logarithmicTree, metric, pointers, queries) ||
+        !CheckNearest(shardedTree, metric, pointers, queries))
+        return false;
+
+    kdTree.Freeze();
+    if (!CheckNearest(kdTree, metric, pointers, queries))
+        return false;
+
+    kdTree.Build(pointers.begin(), pointers.end());
+    for (int i = 0; i < 250; ++i)
+    {
+        EraseRandomPoint(kdTree, pointers, generator);
+    }
+
+    return kdTree.IsFrozen() && CheckNearest(kdTree, metric, pointers, queries);
+}
+
+bool CheckMetrics()
+{
+    std::array<double, 3> weights = {{ 1., 4., 0.25 }};
+    std::array<double, 3> periods = {{ 1000., 1000., 1000. }};
+
+    return CheckNearest(gbi::SquaredEuclideanMetric()) &&
+        CheckNearest(gbi::ManhattanMetric()) &&
+        CheckNearest(gbi::ChebyshevMetric()) &&
+        CheckNearest(gbi::WeightedSquaredEuclideanMetric<3>(weights)) &&
+        CheckNearest(gbi::PeriodicSquaredEuclideanMetric<3>(periods));
+}
+
+// Erasing from a frozen tree only marks nodes, until half of them are gone or Freeze is called again
+// and the rest is rebuilt
+bool CheckFrozenErase()
+{
+    std::mt19937 generator(130);
+    std::vector<Point> pointVector = RandomPoints(generator, 4000);
+
+    gbi::KDTree<PointWrapper, 3, true> kdTree;
+    std::vector<Point *> pointers;
+    std::vector<Point *> erased;
+
+    for (auto & point : pointVector)
+    {
+        pointers.push_back(&point);
+    }
+
+    kdTree.Build(pointers.begin(), pointers.end());
+
+    while (pointers.size() > 100)
+    {
+        for (int i = 0; i < 300; ++i)
+        {
+            erased.push_back(EraseRandomPoint(kdTree, pointers, generator));
+        }
+
+        // Compacting a frozen tree keeps it frozen
+        if (erased.size() % 600 == 0)
+            kdTree.Freeze();
+
+        if (!kdTree.IsFrozen() ||
+            !CheckContains(kdTree, pointers, erased) ||
+            !CheckRangeCount(kdTree, pointers, generator) ||
+            !CheckRangeAggregate(kdTree, pointers, generator))
+            return false;
+    }
+
+    // Thawing drops the erased nodes
+    kdTree.Insert(erased.back());
+    pointers.push_back(erased.back());
+    erased.pop_back();
+
+    return !kdTree.IsFrozen() &&
+        CheckContains(kdTree, pointers, erased) &&
+        CheckRangeAggregate(kdTree, pointers, generator);
+}
+
+// Inserts go through the buffer into frozen levels, erases hit both
+bool CheckLogarithmic()
+{
+    std::mt19937 generator(131);
+    std::vector<Point> pointVector = RandomPoints(generator, 20000);
+
+    gbi::LogarithmicKDTree<PointWrapper, 3, true> logarithmicTree(32);
+    std::vector<Point *> pointers;
+
+    for (size_t i = 0; i < pointVector.size(); ++i)
+    {
+        logarithmicTree.Insert(&pointVector[i]);
+        pointers.push_back(&pointVector[i]);
+
+        if (i % 4 == 3)
+            EraseRandomPoint(logarithmicTree, pointers, generator);
+
+        if (i % 1000 == 999)
+        {
+            if (logarithmicTree.Size() != pointers.size() ||
+                !CheckRangeCount(logarithmicTree, pointers, generator) ||
+                !CheckRangeAggregate(logarithmicTree, pointers, generator))
+                return false;
+        }
+    }
+
+    while (pointers.size() > 1000)
+    {
+        EraseRandomPoint(logarithmicTree, pointers, generator);
+    }
+
+    // A buffer capacity of 0 is taken as 1
+    gbi::LogarithmicKDTree<PointWrapper, 3, true> unbufferedTree(0);
+    for (auto point : pointers)
+    {
+        unbufferedTree.Insert(point);
+    }
+
+    return logarithmicTree.Size() == pointers.size() &&
+        CheckRangeCount(logarithmicTree, pointers, generator) &&
+        CheckRangeAggregate(logarithmicTree, pointers, generator) &&
+        unbufferedTree.Size() == pointers.size() &&
+        CheckRangeAggregate(unbufferedTree, pointers, generator);
+}
+
+// Updates on trees of a constant size, each of them replacing a point with a spare one. Once warm,
+// they should not allocate arrays: that would be a vector or a hash table growing, or a scratch
+// buffer created per call. Node based containers still allocate a node per entry they add, which the
+// pools recycle without going upstream. The levels of the logarithmic tree are rebuilt to fit on
+// every flush, only its upstream allocations are checked.
+bool CheckSteadyStateAllocations()
+{
+    typedef PoolAllocator<gbi::PointData> Allocator;
+
+    std::mt19937 generator(132);
+    std::vector<Point> pointVector = RandomPoints(generator, 750);
+
+    std::vector<Point *> pointers;
+    std::vector<Point *> sparePointers;
+    for (auto & point : pointVector)
+    {
+        (pointers.size() < 500 ? pointers : sparePointers).push_back(&point);
+    }
+
+    BlockPool kdPool;
+    BlockPool logarithmicPool;
+    BlockPool shardedPool;
+    Allocator kdAllocator(kdPool);
+    Allocator logarithmicAllocator(logarithmicPool);
+    Allocator shardedAllocator(shardedPool);
+
+    gbi::KDTree<PointWrapper, 3, true, gbi::SquaredEuclideanMetric, Allocator> kdTree(gbi::SquaredEuclideanMetric(), kdAllocator);
+    gbi::LogarithmicKDTree<PointWrapper, 3, true, gbi::SquaredEuclideanMetric, Allocator> logarithmicTree(32, gbi::SquaredEuclideanMetric(), logarithmicAllocator);
+    gbi::ShardedKDTree<PointWrapper, 3, true, gbi::SquaredEuclideanMetric, Allocator> shardedTree(4, std::vector<gbi::PointData>(pointers.begin(), pointers.end()), gbi::SquaredEuclideanMetric(), shardedAllocator);
+
+    kdTree.Reserve(pointers.size());
+    logarithmicTree.Reserve(pointers.size());
+    // Shard loads drift around their even share
+    shardedTree.Reserve(2 * pointers.size());
+
+    for (auto point : pointers)
+    {
+        kdTree.Insert(point);
+        logarithmicTree.Insert(point);
+        shardedTree.Insert(point);
+
+        while (kdTree.RebalanceIteration());
+    }
+
+    auto update = [&]()
+    {
+        size_t pointIndex = std::uniform_int_distribution<size_t>(0, pointers.size() - 1)(generator);
+        size_t spareIndex = std::uniform_int_distribution<size_t>(0, sparePointers.size() - 1)(generator);
+
+        Point * erased = pointers[pointIndex];
+        Point * inserted = sparePointers[spareIndex];
+        pointers[pointIndex] = inserted;
+        sparePointers[spareIndex] = erased;
+
+        kdTree.Erase(erased);
+        kdTree.Insert(inserted);
+        logarithmicTree.Erase(erased);
+        logarithmicTree.Insert(inserted);
+        shardedTree.Erase(erased);
+        shardedTree.Insert(inserted);
+
+        while (kdTree.RebalanceIteration());
+        shardedTree.RebalanceIteration();
+
+        Point lowerCorner, upperCorner;
+        RandomBox(generator, lowerCorner, upperCorner);
+
+        std::array<double, 3> coordinateSum;
+        kdTree.RangeAggregate(&lowerCorner, &upperCorner, coordinateSum);
+        logarithmicTree.RangeAggregate(&lowerCorner, &upperCorner, coordinateSum);
+        shardedTree.RangeAggregate(&lowerCorner, &upperCorner, coordinateSum);
+
+        kdTree.Nearest(&lowerCorner);
+        logarithmicTree.Nearest(&lowerCorner);
+        shardedTree.Nearest(&lowerCorner);
+    };
+
+    for (int i = 0; i < 1500; ++i)
+    {
+        update();
+    }
+
+    std::array<BlockPool *, 3> pools = {{ &kdPool, &logarithmicPool, &shardedPool }};
+    std::array<size_t, 3> warmUpstreamAllocationCounts;
+    std::array<size_t, 3> warmArrayAllocationCounts;
+    for (size_t i = 0; i < pools.size(); ++i)
+    {
+        warmUpstreamAllocationCounts[i] = pools[i]->UpstreamAllocationCount();
+        warmArrayAllocationCounts[i] = pools[i]->ArrayAllocationCount();
+    }
+
+    for (int i = 0; i < 1500; ++i)
+    {
+        update();
+    }
+
+    for (size_t i = 0; i < pools.size(); ++i)
+    {
+        size_t upstreamAllocationCount = pools[i]->UpstreamAllocationCount() - warmUpstreamAllocationCounts[i];
+        size_t arrayAllocationCount = pools[i]->ArrayAllocationCount() - warmArrayAllocationCounts[i];
+
+        if (upstreamAllocationCount != 0 || (pools[i] != &logarithmicPool && arrayAllocationCount != 0))
+        {
+            std::cout << "Tree " << i << ": " << upstreamAllocationCount << " upstream and " << arrayAllocationCount << " array allocations after warm-up" << std::endl;
+            return false;
+        }
+    }
+
+    return kdTree.Size() == pointers.size() &&
+        logarithmicTree.Size() == pointers.size() &&
+        shardedTree.Size() == pointers.size() &&
+        CheckRangeAggregate(kdTree, pointers, generator) &&
+        CheckRangeAggregate(logarithmicTree, pointers, generator) &&
+        CheckRangeAggregate(shardedTree, pointers, generator);
+}
+
+// Erasing points that were never inserted leaves the trees untouched
+bool CheckEraseUnknownPoint()
+{
+    std::mt19937 generator(134);
+    std::vector<Point> pointVector = RandomPoints(generator, 20);
+    std::vector<Point> unknownPoints = RandomPoints(generator, 5);
+
+    std::vector<Point *> pointers;
+    for (size_t i = 0; i < 9; ++i)
+    {
+        pointers.push_back(&pointVector[i]);
+    }
+
+    gbi::KDTree<PointWrapper, 3, true> kdTree;
+    gbi::ShardedKDTree<PointWrapper, 3, true> shardedTree(2, std::vector<gbi::PointData>(pointers.begin(), pointers.end()));
+
+    for (auto point : pointers)
+    {
+        kdTree.Insert(point);
+        shardedTree.Insert(point);
+    }
+
+    for (size_t i = 9; i < pointVector.size(); ++i)
+    {
+        for (auto & unknownPoint : unknownPoints)
+        {
+            kdTree.Erase(&unknownPoint);
+            shardedTree.Erase(&unknownPoint);
+        }
+
+        if (kdTree.Size() != pointers.size() ||
+            shardedTree.Size() != pointers.size() ||
+            !CheckRangeAggregate(kdTree, pointers, generator) ||
+            !CheckRangeAggregate(shardedTree, pointers, generator))
+            return false;
+
+        kdTree.Insert(&pointVector[i]);
+        shardedTree.Insert(&pointVector[i]);
+        pointers.push_back(&pointVector[i]);
+    }
+
+    return true;
+}
+
+// Writers on several threads while the splits move under them. The sample only covers low
+// coordinates, so that most points first land in the last shard and RebalanceShards has to act.
+bool CheckShardedConcurrentUpdates()
+{
+    std::mt19937 generator(128);
+    std::vector<Point> pointVector = RandomPoints(generator, 20000);
+
+    std::vector<gbi::PointData> sample;
+    for (auto & point : pointVector)
+    {
+        if (point.x < 250.f && point.y < 250.f && point.z < 250.f)
+            sample.push_back(&point);
+    }
+
+    gbi::ShardedKDTree<PointWrapper, 3, true> shardedTree(8, sample);
+
+    // Writer t inserts points t, t + writerCount, ... and erases every other one of them
+    const size_t writerCount = 4;
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < writerCount; ++t)
+    {
+        writers.emplace_back([&pointVector, &shardedTree, t, writerCount]()
+        {
+            for (size_t i = t; i < pointVector.size(); i += writerCount)
+            {
+                shardedTree.Insert(&pointVector[i]);
+
+                if ((i / writerCount) % 2 == 1)
+                    shardedTree.Erase(&pointVector[i - writerCount]);
+            }
+        });
+    }
+
+    std::atomic<bool> writing(true);
+    std::atomic<size_t> splitMoveCount(0);
+    std::thread rebalancer([&shardedTree, &writing, &splitMoveCount]()
+    {
+        while (writing)
+        {
+            if (shardedTree.RebalanceShards())
+                ++splitMoveCount;
+
+            shardedTree.RebalanceIteration();
+        }
+    });
+
+    std::thread reader([&shardedTree, &writing]()
+    {
+        std::mt19937 readerGenerator(129);
+
+        while (writing)
+        {
+            Point lowerCorner, upperCorner;
+            RandomBox(readerGenerator, lowerCorner, upperCorner);
+
+            shardedTree.RangeCount(&lowerCorner, &upperCorner);
+        }
+    });
+
+    for (auto & writer : writers)
+    {
+        writer.join();
+    }
+
+    writing = false;
+    rebalancer.join();
+    reader.join();
+
+    while (shardedTree.RebalanceShards())
+    {
+        ++splitMoveCount;
+    }
+
+    std::vector<Point *> pointers;
+    for (size_t i = 0; i < pointVector.size(); ++i)
+    {
+        if ((i / writerCount) % 2 == 1 || i + writerCount >= pointVector.size())
+            pointers.push_back(&pointVector[i]);
+    }
+
+    return splitMoveCount > 0 &&
+        shardedTree.Size() == pointers.size() &&
+        CheckRangeCount(shardedTree, pointers, generator) &&
+        CheckRangeAggregate(shardedTree, pointers, generator);
+}
+
 int main()
 {
     std::vector<Point> pointVector;
@@ -70,5 +922,61 @@ int main()
 
     std::cout << "Rebalance count: " << rebalanceCount << std::endl;
 
-    return 0;
+    bool success = true;
+
+    if (!CheckRandomErase())
+    {
+        std::cout << "Random erase check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckRangeQueries())
+    {
+        std::cout << "Range query check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckFreezeThaw())
+    {
+        std::cout << "Freeze/Thaw check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckFrozenErase())
+    {
+        std::cout << "Frozen erase check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckLogarithmic())
+    {
+        std::cout << "Logarithmic check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckMetrics())
+    {
+        std::cout << "Metric check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckEraseUnknownPoint())
+    {
+        std::cout << "Unknown point erase check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckSteadyStateAllocations())
+    {
+        std::cout << "Steady state allocation check failed" << std::endl;
+        success = false;
+    }
+
+    if (!CheckShardedConcurrentUpdates())
+    {
+        std::cout << "Sharded concurrent update check failed" << std::endl;
+        success = false;
+    }
+
+    return success ? 0 : 1;
 }